@@ -69,8 +69,9 @@ CDB::CDB(const char* pszFile, const char* pszMode) : pdb(NULL)
 
             dbenv.set_lg_dir(strLogDir.c_str());
             dbenv.set_lg_max(10000000);
-            dbenv.set_lk_max_locks(10000);
-            dbenv.set_lk_max_objects(10000);
+            // CTxDB::Flush writes the whole txdb cache in one transaction
+            dbenv.set_lk_max_locks(537000);
+            dbenv.set_lk_max_objects(537000);
             dbenv.set_errfile(fopen(strErrorFile.c_str(), "a")); /// debug
             dbenv.set_flags(DB_AUTO_COMMIT, 1);
             ret = dbenv.open(strDataDir.c_str(),
@@ -209,6 +210,176 @@ void DBFlush(bool fShutdown)
 // CTxDB
 //
 
+static CCriticalSection cs_txdbcache;
+static map<string, string> mapTxDBDirty;
+static map<string, string> mapTxDBClean;
+static int64 nTxDBCacheUsage = 0;
+
+static inline int64 TxDBRecordUsage(const string& strKey, const string& strValue)
+{
+    // Allow for the map node and string headers too
+    return strKey.size() + strValue.size() + 96;
+}
+
+static void TxDBCacheSetDirty(const string& strKey, const string& strValue)
+{
+    map<string, string>::iterator mi = mapTxDBClean.find(strKey);
+    if (mi != mapTxDBClean.end())
+    {
+        nTxDBCacheUsage -= TxDBRecordUsage((*mi).first, (*mi).second);
+        mapTxDBClean.erase(mi);
+    }
+    mi = mapTxDBDirty.find(strKey);
+    if (mi != mapTxDBDirty.end())
+    {
+        nTxDBCacheUsage -= TxDBRecordUsage((*mi).first, (*mi).second);
+        (*mi).second = strValue;
+    }
+    else
+    {
+        mapTxDBDirty.insert(make_pair(strKey, strValue));
+    }
+    nTxDBCacheUsage += TxDBRecordUsage(strKey, strValue);
+}
+
+bool CTxDB::ReadRecord(const string& strKey, string& strValue)
+{
+    if (!pdb)
+        return false;
+
+    // Our own uncommitted changes come first
+    map<string, string>::iterator mi = mapPending.find(strKey);
+    if (mi != mapPending.end())
+    {
+        strValue = (*mi).second;
+        return !strValue.empty();
+    }
+
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        mi = mapTxDBDirty.find(strKey);
+        if (mi != mapTxDBDirty.end())
+        {
+            strValue = (*mi).second;
+            return !strValue.empty();
+        }
+        mi = mapTxDBClean.find(strKey);
+        if (mi != mapTxDBClean.end())
+        {
+            strValue = (*mi).second;
+            return true;
+        }
+
+        // Read from the database, holding the lock so a flush can't
+        // slip in underneath and leave a stale record in the cache
+        Dbt datKey((void*)strKey.data(), strKey.size());
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pdb->get(NULL, &datKey, &datValue, 0);
+        if (datValue.get_data() == NULL)
+            return false;
+        strValue.assign((char*)datValue.get_data(), datValue.get_size());
+        free(datValue.get_data());
+        if (ret != 0 || strValue.empty())
+            return false;
+
+        mapTxDBClean.insert(make_pair(strKey, strValue));
+        nTxDBCacheUsage += TxDBRecordUsage(strKey, strValue);
+    }
+    return true;
+}
+
+bool CTxDB::WriteRecord(const string& strKey, const string& strValue)
+{
+    if (!pdb)
+        return false;
+    if (fTxn)
+    {
+        mapPending[strKey] = strValue;
+        return true;
+    }
+    CRITICAL_BLOCK(cs_txdbcache)
+        TxDBCacheSetDirty(strKey, strValue);
+    return Flush();
+}
+
+bool CTxDB::TxnBegin()
+{
+    if (!pdb || fTxn)
+        return false;
+    fTxn = true;
+    return true;
+}
+
+bool CTxDB::TxnCommit()
+{
+    if (!pdb || !fTxn)
+        return false;
+    CRITICAL_BLOCK(cs_txdbcache)
+        BOOST_FOREACH(const PAIRTYPE(string, string)& item, mapPending)
+            TxDBCacheSetDirty(item.first, item.second);
+    mapPending.clear();
+    fTxn = false;
+    return Flush();
+}
+
+bool CTxDB::TxnAbort()
+{
+    if (!pdb || !fTxn)
+        return false;
+    mapPending.clear();
+    fTxn = false;
+    return true;
+}
+
+bool CTxDB::Flush(bool fForce)
+{
+    if (!pdb)
+        return false;
+
+    CRITICAL_BLOCK(cs_txdbcache)
+    {
+        if (!fForce && nTxDBCacheUsage < GetArg("-dbcache", 25) << 20)
+            return true;
+
+        if (!mapTxDBDirty.empty())
+        {
+            int64 nStart = GetTimeMillis();
+            if (!CDB::TxnBegin())
+                return error("CTxDB::Flush() : TxnBegin failed");
+            BOOST_FOREACH(const PAIRTYPE(string, string)& item, mapTxDBDirty)
+            {
+                Dbt datKey((void*)item.first.data(), item.first.size());
+                int ret;
+                if (item.second.empty())
+                {
+                    ret = pdb->del(GetTxn(), &datKey, 0);
+                    if (ret == DB_NOTFOUND)
+                        ret = 0;
+                }
+                else
+                {
+                    Dbt datValue((void*)item.second.data(), item.second.size());
+                    ret = pdb->put(GetTxn(), &datKey, &datValue, 0);
+                }
+                if (ret != 0)
+                {
+                    CDB::TxnAbort();
+                    return error("CTxDB::Flush() : error %d writing to blkindex.dat", ret);
+                }
+            }
+            if (!CDB::TxnCommit())
+                return error("CTxDB::Flush() : TxnCommit failed");
+            printf("CTxDB::Flush() : wrote %d records in %"PRI64d"ms\n", mapTxDBDirty.size(), GetTimeMillis() - nStart);
+        }
+
+        mapTxDBDirty.clear();
+        mapTxDBClean.clear();
+        nTxDBCacheUsage = 0;
+    }
+    return true;
+}
+
 bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
 {
     assert(!fClient);
@@ -226,10 +397,12 @@ bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeigh
 {
     assert(!fClient);
 
-    // Add to tx index
+    // Add to tx index and its outputs to the unspent coins
     uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
+    CTxIndex txindex(pos, nHeight);
+    if (!Write(make_pair(string("tx"), hash), txindex))
+        return false;
+    return WriteCoins(hash, CCoins(tx, nHeight));
 }
 
 bool CTxDB::EraseTxIndex(const CTransaction& tx)
@@ -237,6 +410,8 @@ bool CTxDB::EraseTxIndex(const CTransaction& tx)
     assert(!fClient);
     uint256 hash = tx.GetHash();
 
+    if (!Erase(make_pair(string("coins"), hash)))
+        return false;
     return Erase(make_pair(string("tx"), hash));
 }
 
@@ -246,6 +421,21 @@ bool CTxDB::ContainsTx(uint256 hash)
     return Exists(make_pair(string("tx"), hash));
 }
 
+bool CTxDB::ReadCoins(uint256 hash, CCoins& coins)
+{
+    assert(!fClient);
+    coins.SetNull();
+    return Read(make_pair(string("coins"), hash), coins);
+}
+
+bool CTxDB::WriteCoins(uint256 hash, const CCoins& coins)
+{
+    assert(!fClient);
+    if (coins.IsPruned())
+        return Erase(make_pair(string("coins"), hash));
+    return Write(make_pair(string("coins"), hash), coins);
+}
+
 bool CTxDB::ReadOwnerTxes(uint160 hash160, int nMinHeight, vector<CTransaction>& vtx)
 {
     assert(!fClient);
@@ -326,6 +516,26 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
+bool CTxDB::ReadBlockUndoPos(uint256 hashBlock, unsigned int& nFile, unsigned int& nUndoPos)
+{
+    pair<unsigned int, unsigned int> pos;
+    if (!Read(make_pair(string("blockundo"), hashBlock), pos))
+        return false;
+    nFile = pos.first;
+    nUndoPos = pos.second;
+    return true;
+}
+
+bool CTxDB::WriteBlockUndoPos(uint256 hashBlock, unsigned int nFile, unsigned int nUndoPos)
+{
+    return Write(make_pair(string("blockundo"), hashBlock), make_pair(nFile, nUndoPos));
+}
+
+bool CTxDB::EraseBlockUndoPos(uint256 hashBlock)
+{
+    return Erase(make_pair(string("blockundo"), hashBlock));
+}
+
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
     return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
@@ -346,14 +556,19 @@ bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
     return Write(string("hashBestChain"), hashBestChain);
 }
 
-bool CTxDB::ReadBestInvalidWork(CBigNum& bnBestInvalidWork)
+bool CTxDB::ReadBestInvalidWork(uint256& nBestInvalidWork)
 {
-    return Read(string("bnBestInvalidWork"), bnBestInvalidWork);
+    // Stored as a CBigNum by older versions
+    CBigNum bnBestInvalidWork;
+    if (!Read(string("bnBestInvalidWork"), bnBestInvalidWork))
+        return false;
+    nBestInvalidWork = bnBestInvalidWork.getuint256();
+    return true;
 }
 
-bool CTxDB::WriteBestInvalidWork(CBigNum bnBestInvalidWork)
+bool CTxDB::WriteBestInvalidWork(uint256 nBestInvalidWork)
 {
-    return Write(string("bnBestInvalidWork"), bnBestInvalidWork);
+    return Write(string("bnBestInvalidWork"), CBigNum(nBestInvalidWork));
 }
 
 CBlockIndex* InsertBlockIndex(uint256 hash)
@@ -362,12 +577,12 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex();
     if (!pindexNew)
         throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
@@ -376,7 +591,221 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool CTxDB::LoadBlockIndex()
+
+
+
+//
+// Block index snapshot
+//
+// A flat copy of the block index written on clean shutdown.  Entries are in
+// height order and refer to their neighbours by position, so startup can map
+// the file and link the whole index in one pass instead of walking the
+// database.  The file is removed once read so it can never go stale behind a
+// crash; the database walk is the fallback whenever it doesn't check out.
+//
+
+static const unsigned int BLOCKINDEX_SNAPSHOT_MAGIC = 0xb10c1dc5;
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+class CBlockIndexSnapshotHeader
+{
+public:
+    unsigned int nMagic;
+    int nVersion;
+    unsigned int nEntrySize;
+    unsigned int nCount;
+    uint256 hashBestChain;
+    uint256 hashChecksum;
+};
+
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hashBlock;
+    int nPrev;
+    int nNext;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    int nHeight;
+    int nVersion;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    uint256 nChainWork;
+};
+
+static string GetBlockIndexSnapshotFile()
+{
+    return GetDataDir() + "/blkindex.snapshot";
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    if (GetBoolArg("-noindexsnapshot") || pindexBest == NULL)
+        return false;
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    boost::unordered_map<const CBlockIndex*, int> mapPos;
+    for (int i = 0; i < vSortedByHeight.size(); i++)
+        mapPos[vSortedByHeight[i].second] = i;
+
+    vector<CBlockIndexSnapshotEntry> vEntry(vSortedByHeight.size());
+    for (int i = 0; i < vSortedByHeight.size(); i++)
+    {
+        const CBlockIndex* pindex = vSortedByHeight[i].second;
+        CBlockIndexSnapshotEntry& entry = vEntry[i];
+        entry.hashBlock      = pindex->GetBlockHash();
+        entry.nPrev          = pindex->pprev ? mapPos[pindex->pprev] : -1;
+        entry.nNext          = pindex->pnext ? mapPos[pindex->pnext] : -1;
+        entry.nFile          = pindex->nFile;
+        entry.nBlockPos      = pindex->nBlockPos;
+        entry.nHeight        = pindex->nHeight;
+        entry.nVersion       = pindex->nVersion;
+        entry.hashMerkleRoot = pindex->hashMerkleRoot;
+        entry.nTime          = pindex->nTime;
+        entry.nBits          = pindex->nBits;
+        entry.nNonce         = pindex->nNonce;
+        entry.nChainWork     = pindex->nChainWork;
+    }
+
+    CBlockIndexSnapshotHeader header;
+    header.nMagic        = BLOCKINDEX_SNAPSHOT_MAGIC;
+    header.nVersion      = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nEntrySize    = sizeof(CBlockIndexSnapshotEntry);
+    header.nCount        = vEntry.size();
+    header.hashBestChain = hashBestChain;
+    header.hashChecksum  = Hash(vEntry.begin(), vEntry.end());
+
+    // Write to a temp file and rename it into place
+    string strFile = GetBlockIndexSnapshotFile();
+    string strTmp = strFile + ".new";
+    FILE* file = fopen(strTmp.c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open failed");
+    bool fOk = (fwrite(&header, sizeof(header), 1, file) == 1);
+    if (fOk && !vEntry.empty())
+        fOk = (fwrite(&vEntry[0], sizeof(vEntry[0]), vEntry.size(), file) == vEntry.size());
+    if (fclose(file) != 0)
+        fOk = false;
+    if (!fOk)
+    {
+        boost::filesystem::remove(strTmp);
+        return error("WriteBlockIndexSnapshot() : write failed");
+    }
+    boost::filesystem::remove(strFile);
+    boost::filesystem::rename(strTmp, strFile);
+    printf("WriteBlockIndexSnapshot() : wrote %d entries\n", header.nCount);
+    return true;
+}
+
+static bool LinkBlockIndexSnapshot(const char* pdata, unsigned int nSize, const uint256& hashBestChainDB)
+{
+    if (nSize < sizeof(CBlockIndexSnapshotHeader))
+        return error("LinkBlockIndexSnapshot() : file too short");
+    const CBlockIndexSnapshotHeader& header = *(const CBlockIndexSnapshotHeader*)pdata;
+    if (header.nMagic != BLOCKINDEX_SNAPSHOT_MAGIC ||
+        header.nVersion != BLOCKINDEX_SNAPSHOT_VERSION ||
+        header.nEntrySize != sizeof(CBlockIndexSnapshotEntry))
+        return error("LinkBlockIndexSnapshot() : unknown format");
+    if (nSize != sizeof(header) + (uint64)header.nCount * sizeof(CBlockIndexSnapshotEntry))
+        return error("LinkBlockIndexSnapshot() : size mismatch");
+    if (header.hashBestChain != hashBestChainDB)
+        return error("LinkBlockIndexSnapshot() : snapshot is stale");
+    const CBlockIndexSnapshotEntry* pbegin = (const CBlockIndexSnapshotEntry*)(pdata + sizeof(header));
+    const CBlockIndexSnapshotEntry* pend = pbegin + header.nCount;
+    if (Hash(pbegin, pend) != header.hashChecksum)
+        return error("LinkBlockIndexSnapshot() : checksum mismatch");
+
+    mapBlockIndex.rehash(header.nCount);
+    vector<CBlockIndex*> vIndex(header.nCount);
+    for (int i = 0; i < header.nCount; i++)
+    {
+        const CBlockIndexSnapshotEntry& entry = pbegin[i];
+        if (entry.nPrev < -1 || entry.nPrev >= i)
+        {
+            mapBlockIndex.clear();
+            pindexGenesisBlock = NULL;
+            return error("LinkBlockIndexSnapshot() : bad parent at %d", i);
+        }
+
+        CBlockIndex* pindexNew = InsertBlockIndex(entry.hashBlock);
+        pindexNew->pprev          = (entry.nPrev == -1 ? NULL : vIndex[entry.nPrev]);
+        pindexNew->nFile          = entry.nFile;
+        pindexNew->nBlockPos      = entry.nBlockPos;
+        pindexNew->nHeight        = entry.nHeight;
+        pindexNew->nChainWork     = entry.nChainWork;
+        pindexNew->nVersion       = entry.nVersion;
+        pindexNew->hashMerkleRoot = entry.hashMerkleRoot;
+        pindexNew->nTime          = entry.nTime;
+        pindexNew->nBits          = entry.nBits;
+        pindexNew->nNonce         = entry.nNonce;
+        if (pindexNew->pprev && pbegin[entry.nPrev].nNext == i)
+            pindexNew->pprev->pnext = pindexNew;
+        pindexNew->BuildSkip();
+        vIndex[i] = pindexNew;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && entry.hashBlock == hashGenesisBlock)
+            pindexGenesisBlock = pindexNew;
+    }
+    return true;
+}
+
+bool CTxDB::ReadBlockIndexSnapshot()
+{
+    string strFile = GetBlockIndexSnapshotFile();
+    if (!boost::filesystem::exists(strFile))
+        return false;
+
+    bool fLoaded = false;
+    uint256 hashBestChainDB;
+    if (!GetBoolArg("-noindexsnapshot") && ReadHashBestChain(hashBestChainDB))
+    {
+#ifdef __WXMSW__
+        vector<char> vData;
+        FILE* file = fopen(strFile.c_str(), "rb");
+        if (file)
+        {
+            fseek(file, 0, SEEK_END);
+            vData.resize(max(ftell(file), 0L));
+            fseek(file, 0, SEEK_SET);
+            if (!vData.empty() && fread(&vData[0], 1, vData.size(), file) == vData.size())
+                fLoaded = LinkBlockIndexSnapshot(&vData[0], vData.size(), hashBestChainDB);
+            fclose(file);
+        }
+#else
+        int fd = open(strFile.c_str(), O_RDONLY);
+        if (fd != -1)
+        {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void* pdata = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (pdata != MAP_FAILED)
+                {
+                    fLoaded = LinkBlockIndexSnapshot((const char*)pdata, st.st_size, hashBestChainDB);
+                    munmap(pdata, st.st_size);
+                }
+            }
+            close(fd);
+        }
+#endif
+    }
+
+    // Only good until the index changes again
+    boost::filesystem::remove(strFile);
+    if (fLoaded)
+        printf("LoadBlockIndex(): loaded %d entries from snapshot\n", mapBlockIndex.size());
+    return fLoaded;
+}
+
+bool CTxDB::ReadBlockIndexRecords()
 {
     // Get database cursor
     Dbc* pcursor = GetCursor();
@@ -434,7 +863,7 @@ bool CTxDB::LoadBlockIndex()
     }
     pcursor->close();
 
-    // Calculate bnChainWork
+    // Calculate nChainWork and skip pointers
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -446,25 +875,46 @@ bool CTxDB::LoadBlockIndex()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
     }
 
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    // Use the snapshot from the last clean shutdown if there is one
+    if (!ReadBlockIndexSnapshot())
+        if (!ReadBlockIndexRecords())
+            return false;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
         if (pindexGenesisBlock == NULL)
+        {
+            // New database, the coins are kept from the start
+            if (!fReadOnly)
+                Write(string("coinsversion"), VERSION);
             return true;
+        }
         return error("CTxDB::LoadBlockIndex() : hashBestChain not loaded");
     }
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexBest->bnChainWork;
+    nBestChainWork = pindexBest->nChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
 
-    // Load bnBestInvalidWork, OK if it doesn't exist
-    ReadBestInvalidWork(bnBestInvalidWork);
+    // Load nBestInvalidWork, OK if it doesn't exist
+    ReadBestInvalidWork(nBestInvalidWork);
+
+    // Build the unspent coins from a tx index written by an older version
+    if (!Exists(string("coinsversion")))
+        if (!UpgradeToCoins())
+            return error("CTxDB::LoadBlockIndex() : UpgradeToCoins failed");
 
     // Verify blocks in the best chain
     CBlockIndex* pindexFork = NULL;
@@ -496,82 +946,288 @@ bool CTxDB::LoadBlockIndex()
 }
 
 
-
-
-
 //
-// CAddrDB
+// Old tx index records carry a vector with the spending location of each
+// output.  Rewrite them without it, and create a coins record with the
+// still unspent outputs of each transaction.  Progress is saved in the
+// same flush as each batch, so an interrupted upgrade carries on where it
+// left off.
 //
-
-bool CAddrDB::WriteAddress(const CAddress& addr)
+class CTxIndexV1
 {
-    return Write(make_pair(string("addr"), addr.GetKey()), addr);
-}
-
-bool CAddrDB::EraseAddress(const CAddress& addr)
+public:
+    CDiskTxPos pos;
+    vector<CDiskTxPos> vSpent;
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(pos);
+        READWRITE(vSpent);
+    )
+};
+
+bool CTxDB::UpgradeToCoins()
 {
-    return Erase(make_pair(string("addr"), addr.GetKey()));
-}
+    if (fReadOnly)
+        return error("CTxDB::UpgradeToCoins() : database opened read only");
+    printf("Upgrading blkindex.dat to unspent coins...\n");
+    int64 nStart = GetTimeMillis();
 
-bool CAddrDB::LoadAddresses()
-{
-    CRITICAL_BLOCK(cs_mapAddresses)
-    {
-        // Load user provided addresses
-        CAutoFile filein = fopen((GetDataDir() + "/addr.txt").c_str(), "rt");
-        if (filein)
-        {
-            try
-            {
-                char psz[1000];
-                while (fgets(psz, sizeof(psz), filein))
-                {
-                    CAddress addr(psz, NODE_NETWORK);
-                    addr.nTime = 0; // so it won't relay unless successfully connected
-                    if (addr.IsValid())
-                        AddAddress(addr);
-                }
-            }
-            catch (...) { }
-        }
+    // Heights of the main chain blocks by their position on disk
+    map<pair<unsigned int, unsigned int>, int> mapBlockHeight;
+    for (CBlockIndex* pindex = pindexBest; pindex; pindex = pindex->pprev)
+        mapBlockHeight[make_pair(pindex->nFile, pindex->nBlockPos)] = pindex->nHeight;
 
-        // Get cursor
+    uint256 hashNext = 0;
+    Read(string("coinsupgrade"), hashNext);
+
+    int nUpgraded = 0;
+    bool fDone = false;
+    while (!fDone)
+    {
+        // Work in batches, with no cursor open while the batch is flushed
         Dbc* pcursor = GetCursor();
         if (!pcursor)
             return false;
+        TxnBegin();
 
+        unsigned int fFlags = DB_SET_RANGE;
+        int nBatch = 0;
         loop
         {
             // Read next record
             CDataStream ssKey;
+            if (fFlags == DB_SET_RANGE)
+                ssKey << make_pair(string("tx"), hashNext);
             CDataStream ssValue;
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
             if (ret == DB_NOTFOUND)
+            {
+                fDone = true;
                 break;
+            }
             else if (ret != 0)
+            {
+                pcursor->close();
+                TxnAbort();
                 return false;
+            }
 
             // Unserialize
             string strType;
             ssKey >> strType;
-            if (strType == "addr")
+            if (strType != "tx")
             {
-                CAddress addr;
-                ssValue >> addr;
-                mapAddresses.insert(make_pair(addr.GetKey(), addr));
+                fDone = true;
+                break;
+            }
+            uint256 hash;
+            ssKey >> hash;
+            if (nBatch >= 10000)
+            {
+                hashNext = hash;
+                break;
+            }
+            CTxIndexV1 txindexOld;
+            ssValue >> txindexOld;
+            map<pair<unsigned int, unsigned int>, int>::iterator mi = mapBlockHeight.find(make_pair(txindexOld.pos.nFile, txindexOld.pos.nBlockPos));
+            int nHeight = (mi == mapBlockHeight.end() ? -1 : (*mi).second);
+
+            bool fUnspent = false;
+            BOOST_FOREACH(const CDiskTxPos& posSpent, txindexOld.vSpent)
+                if (posSpent.IsNull())
+                    fUnspent = true;
+            if (fUnspent)
+            {
+                CTransaction tx;
+                if (!tx.ReadFromDisk(txindexOld.pos))
+                {
+                    pcursor->close();
+                    TxnAbort();
+                    return error("CTxDB::UpgradeToCoins() : ReadFromDisk failed for %s", hash.ToString().substr(0,10).c_str());
+                }
+                if (nHeight < 0 || tx.vout.size() != txindexOld.vSpent.size())
+                {
+                    pcursor->close();
+                    TxnAbort();
+                    return error("CTxDB::UpgradeToCoins() : tx index entry for %s doesn't match the block chain", hash.ToString().substr(0,10).c_str());
+                }
+                CCoins coins(tx, nHeight);
+                for (int i = 0; i < coins.vout.size(); i++)
+                    if (!txindexOld.vSpent[i].IsNull())
+                        coins.vout[i].SetNull();
+                Write(make_pair(string("coins"), hash), coins);
             }
+            Write(make_pair(string("tx"), hash), CTxIndex(txindexOld.pos, nHeight));
+            nBatch++;
         }
         pcursor->close();
 
-        printf("Loaded %d addresses\n", mapAddresses.size());
+        nUpgraded += nBatch;
+        if (fDone)
+        {
+            Erase(string("coinsupgrade"));
+            Write(string("coinsversion"), VERSION);
+        }
+        else
+        {
+            Write(string("coinsupgrade"), hashNext);
+            printf("UpgradeToCoins() : %d transactions done\n", nUpgraded);
+        }
+        if (!TxnCommit() || !Flush(true))
+            return false;
+    }
+
+    printf("UpgradeToCoins() : upgraded %d transactions in %"PRI64d"ms\n", nUpgraded, GetTimeMillis() - nStart);
+    return true;
+}
+
+
+
+
+
+//
+// CAddrDB
+//
+
+// Moves the records of the old flat table into the address manager
+bool CAddrDB::LoadAddresses()
+{
+    // Get cursor
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
+
+    int nCount = 0;
+    loop
+    {
+        // Read next record
+        CDataStream ssKey;
+        CDataStream ssValue;
+        int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+        if (ret == DB_NOTFOUND)
+            break;
+        else if (ret != 0)
+            return false;
+
+        // Unserialize
+        string strType;
+        ssKey >> strType;
+        if (strType == "addr")
+        {
+            CAddress addr;
+            ssValue >> addr;
+            if (addr.IsValid())
+                addrman.Add(addr, addr);
+            nCount++;
+        }
     }
+    pcursor->close();
 
+    printf("Migrated %d addresses from addr.dat\n", nCount);
+    return true;
+}
+
+static string GetPeersFile()
+{
+    return GetDataDir() + "/peers.dat";
+}
+
+static bool ReadAddresses()
+{
+    string strFile = GetPeersFile();
+    if (!boost::filesystem::exists(strFile))
+        return false;
+
+    vector<char> vData;
+    FILE* file = fopen(strFile.c_str(), "rb");
+    if (!file)
+        return error("ReadAddresses() : open failed");
+    fseek(file, 0, SEEK_END);
+    vData.resize(max(ftell(file), 0L));
+    fseek(file, 0, SEEK_SET);
+    bool fOk = (!vData.empty() && fread(&vData[0], 1, vData.size(), file) == vData.size());
+    fclose(file);
+    if (!fOk || vData.size() < sizeof(pchMessageStart) + sizeof(uint256))
+        return error("ReadAddresses() : read failed");
+
+    // Trailing checksum covers everything before it
+    const char* pbegin = &vData[0];
+    const char* pend = pbegin + vData.size() - sizeof(uint256);
+    uint256 hashChecksum;
+    memcpy(&hashChecksum, pend, sizeof(hashChecksum));
+    if (Hash(pbegin, pend) != hashChecksum)
+        return error("ReadAddresses() : checksum mismatch");
+    if (memcmp(pbegin, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return error("ReadAddresses() : wrong network");
+
+    CDataStream ss(pbegin + sizeof(pchMessageStart), pend, SER_DISK);
+    try
+    {
+        ss >> addrman;
+    }
+    catch (std::exception& e)
+    {
+        return error("ReadAddresses() : deserialize failed");
+    }
+    return true;
+}
+
+bool DumpAddresses()
+{
+    CDataStream ss(SER_DISK);
+    ss << FLATDATA(pchMessageStart) << addrman;
+    uint256 hashChecksum = Hash(ss.begin(), ss.end());
+    ss << hashChecksum;
+
+    // Write to a temp file and rename it into place
+    string strFile = GetPeersFile();
+    string strTmp = strFile + ".new";
+    FILE* file = fopen(strTmp.c_str(), "wb");
+    if (!file)
+        return error("DumpAddresses() : open failed");
+    bool fOk = (fwrite(&ss[0], 1, ss.size(), file) == ss.size());
+    if (fclose(file) != 0)
+        fOk = false;
+    if (!fOk)
+    {
+        boost::filesystem::remove(strTmp);
+        return error("DumpAddresses() : write failed");
+    }
+    // Renaming over the old file replaces it in one step, so there's always
+    // a complete peers.dat
+    boost::filesystem::rename(strTmp, strFile);
     return true;
 }
 
 bool LoadAddresses()
 {
-    return CAddrDB("cr+").LoadAddresses();
+    // Fall back to the old table if there's no usable peers.dat
+    bool fRet = (ReadAddresses() || CAddrDB("cr+").LoadAddresses());
+
+    // Load user provided addresses
+    CAutoFile filein = fopen((GetDataDir() + "/addr.txt").c_str(), "rt");
+    if (filein)
+    {
+        try
+        {
+            char psz[1000];
+            while (fgets(psz, sizeof(psz), filein))
+            {
+                CAddress addr(psz, NODE_NETWORK);
+                addr.nTime = 0; // so it won't relay unless successfully connected
+                if (addr.IsValid())
+                    AddAddress(addr);
+            }
+        }
+        catch (...) { }
+    }
+
+    printf("Loaded %d addresses\n", addrman.size());
+    return fRet;
 }
 
 
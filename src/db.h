@@ -14,6 +14,7 @@
 
 class CTransaction;
 class CTxIndex;
+class CCoins;
 class CDiskBlockIndex;
 class CDiskTxPos;
 class COutPoint;
@@ -273,19 +274,97 @@ public:
 
 
 
+//
+// Records read and written through CTxDB are kept in a cache shared by all
+// CTxDB objects.  Changes made inside a transaction stay private to that
+// CTxDB until TxnCommit, then join the shared cache, which is written to
+// blkindex.dat in one large transaction once it grows past -dbcache
+// megabytes.  Everything goes through the cache together, so what is on
+// disk always matches its hashBestChain.
+//
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { fTxn = false; }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+
+    // Serialized key -> serialized value of changes not yet committed,
+    // an empty value means the record was erased
+    std::map<std::string, std::string> mapPending;
+    bool fTxn;
+
+    static std::string GetKeyString(const CDataStream& ssKey)
+    {
+        return std::string(ssKey.begin(), ssKey.end());
+    }
+
+    bool ReadRecord(const std::string& strKey, std::string& strValue);
+    bool WriteRecord(const std::string& strKey, const std::string& strValue);
+
+protected:
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        CDataStream ssKey(SER_DISK);
+        ssKey << key;
+        std::string strValue;
+        if (!ReadRecord(GetKeyString(ssKey), strValue))
+            return false;
+        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK);
+        ssValue >> value;
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(("Write called on database in read-only mode", false));
+        CDataStream ssKey(SER_DISK);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK);
+        ssValue.reserve(1000);
+        ssValue << value;
+        return WriteRecord(GetKeyString(ssKey), std::string(ssValue.begin(), ssValue.end()));
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(("Erase called on database in read-only mode", false));
+        CDataStream ssKey(SER_DISK);
+        ssKey << key;
+        return WriteRecord(GetKeyString(ssKey), std::string());
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        CDataStream ssKey(SER_DISK);
+        ssKey << key;
+        std::string strValue;
+        return ReadRecord(GetKeyString(ssKey), strValue);
+    }
+
 public:
+    bool TxnBegin();
+    bool TxnCommit();
+    bool TxnAbort();
+    bool Flush(bool fForce=false);
+
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
     bool AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight);
     bool EraseTxIndex(const CTransaction& tx);
     bool ContainsTx(uint256 hash);
+    bool ReadCoins(uint256 hash, CCoins& coins);
+    bool WriteCoins(uint256 hash, const CCoins& coins);
+    bool ReadBlockUndoPos(uint256 hashBlock, unsigned int& nFile, unsigned int& nUndoPos);
+    bool WriteBlockUndoPos(uint256 hashBlock, unsigned int nFile, unsigned int nUndoPos);
+    bool EraseBlockUndoPos(uint256 hashBlock);
     bool ReadOwnerTxes(uint160 hash160, int nHeight, std::vector<CTransaction>& vtx);
     bool ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
@@ -295,11 +374,17 @@ public:
     bool EraseBlockIndex(uint256 hash);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
-    bool ReadBestInvalidWork(CBigNum& bnBestInvalidWork);
-    bool WriteBestInvalidWork(CBigNum bnBestInvalidWork);
+    bool ReadBestInvalidWork(uint256& nBestInvalidWork);
+    bool WriteBestInvalidWork(uint256 nBestInvalidWork);
     bool LoadBlockIndex();
+private:
+    bool ReadBlockIndexSnapshot();
+    bool ReadBlockIndexRecords();
+    bool UpgradeToCoins();
 };
 
+bool WriteBlockIndexSnapshot();
+
 
 
 
@@ -312,12 +397,11 @@ private:
     CAddrDB(const CAddrDB&);
     void operator=(const CAddrDB&);
 public:
-    bool WriteAddress(const CAddress& addr);
-    bool EraseAddress(const CAddress& addr);
     bool LoadAddresses();
 };
 
 bool LoadAddresses();
+bool DumpAddresses();
 
 
 
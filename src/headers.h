@@ -61,12 +61,14 @@
 #include <numeric>
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/tuple/tuple_comparison.hpp>
 #include <boost/tuple/tuple_io.hpp>
 #include <boost/array.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/algorithm/string.hpp>
@@ -94,6 +96,7 @@
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -102,6 +105,9 @@
 #include <ifaddrs.h>
 #include <fcntl.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #endif
 #ifdef BSD
 #include <netinet/in.h>
@@ -36,6 +36,10 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        CTxDB().Flush(true);
+        CRITICAL_BLOCK(cs_main)
+            WriteBlockIndexSnapshot();
+        DumpAddresses();
         DBFlush(true);
         boost::filesystem::remove(GetPidFile());
         CreateThread(ExitTimeout, NULL);
@@ -156,7 +160,13 @@ bool AppInit2(int argc, char* argv[])
             "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect\n") +
             "  -addnode=<ip>    \t  "   + _("Add a node to connect to\n") +
             "  -connect=<ip>    \t\t  " + _("Connect only to the specified node\n") +
+            "  -timeout=<n>     \t  "   + _("Connection timeout in milliseconds (default: 5000)\n") +
             "  -nolisten        \t  "   + _("Don't accept connections from outside\n") +
+            "  -nocompactblocks \t  "   + _("Always download whole blocks instead of rebuilding them from the memory pool\n") +
+            "  -msghandlers=<n> \t  "   + _("Number of threads to process peer messages with (default: up to 4)\n") +
+#ifdef __linux__
+            "  -noepoll         \t  "   + _("Wait on sockets with select instead of epoll\n") +
+#endif
 #ifdef USE_UPNP
 #if USE_UPNP
             "  -noupnp          \t  "   + _("Don't attempt to use UPnP to map the listening port\n") +
@@ -178,6 +188,13 @@ bool AppInit2(int argc, char* argv[])
             "  -rpcallowip=<ip> \t\t  " + _("Allow JSON-RPC connections from specified IP address\n") +
             "  -rpcconnect=<ip> \t  "   + _("Send commands to node running on <ip> (default: 127.0.0.1)\n") +
             "  -keypool=<n>     \t  "   + _("Set key pool size to <n> (default: 100)\n") +
+            "  -par=<n>         \t  "   + _("Number of threads to verify signatures with (default: one per core)\n") +
+            "  -maxsigcachesize=<n>\t  " + _("Number of verified signatures to cache (default: 50000)\n") +
+            "  -blockcachesize=<n>\t  " + _("Megabytes of recently served blocks to cache (default: 8)\n") +
+            "  -dbcache=<n>     \t  "   + _("Megabytes of block index records to cache in memory (default: 25)\n") +
+            "  -noindexsnapshot \t  "   + _("Don't keep a snapshot of the block index for faster startup\n") +
+            "  -assumevalid=<hash>\t  " + _("Don't check scripts in blocks buried under this one (0 to check all)\n") +
+            "  -mmapblocks      \t  "   + _("Read block files through memory maps (64-bit only)\n") +
             "  -rescan          \t  "   + _("Rescan the block chain for missing wallet transactions\n");
 
 #ifdef USE_SSL
@@ -356,6 +373,8 @@ bool AppInit2(int argc, char* argv[])
         strErrors += _("Error loading addr.dat      \n");
     printf(" addresses   %15"PRI64d"ms\n", GetTimeMillis() - nStart);
 
+    StartScriptCheckThreads();
+
     printf("Loading block index...\n");
     nStart = GetTimeMillis();
     if (!LoadBlockIndex())
@@ -419,7 +438,7 @@ bool AppInit2(int argc, char* argv[])
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
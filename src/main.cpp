@@ -13,29 +13,30 @@ using namespace boost;
 
 CCriticalSection cs_main;
 
-map<uint256, CTransaction> mapTransactions;
+TxMap mapTransactions;
 CCriticalSection cs_mapTransactions;
 unsigned int nTransactionsUpdated = 0;
-map<COutPoint, CInPoint> mapNextTx;
+boost::unordered_map<COutPoint, CInPoint, CSaltedHasher> mapNextTx;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 uint256 hashGenesisBlock("0x000000000019d6689c085ae165831e934ff763ae46a2a6c172b3f1b60a8ce26f");
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 32);
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainWork = 0;
-CBigNum bnBestInvalidWork = 0;
+uint256 nBestChainWork = 0;
+uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
+uint256 hashAssumeValid("0x000000000000774a7f8a7a12dc906ddb9e17e75d684f15e00f8767f9e8f36553");
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
 
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
-map<uint256, CDataStream*> mapOrphanTransactions;
-multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
+map<uint256, CTransaction> mapOrphanTransactions;
+boost::unordered_map<COutPoint, set<uint256>, CSaltedHasher> mapOrphanTransactionsByPrev;
 
-map<uint256, CWalletTx> mapWallet;
+WalletMap mapWallet;
 vector<uint256> vWalletUpdated;
 CCriticalSection cs_mapWallet;
 
@@ -114,7 +115,7 @@ bool AddToWallet(const CWalletTx& wtxIn)
     CRITICAL_BLOCK(cs_mapWallet)
     {
         // Inserts only if not already there, returns tx inserted or tx found
-        pair<map<uint256, CWalletTx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
+        pair<WalletMap::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
         CWalletTx& wtx = (*ret.first).second;
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
@@ -207,7 +208,7 @@ void WalletUpdateSpent(const COutPoint& prevout)
     // restored from backup or the user making copies of wallet.dat.
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
+        WalletMap::iterator mi = mapWallet.find(prevout.hash);
         if (mi != mapWallet.end())
         {
             CWalletTx& wtx = (*mi).second;
@@ -234,38 +235,102 @@ void WalletUpdateSpent(const COutPoint& prevout)
 // mapOrphanTransactions
 //
 
-void AddOrphanTx(const CDataStream& vMsg)
+bool AddOrphanTx(const CTransaction& tx)
 {
-    CTransaction tx;
-    CDataStream(vMsg) >> tx;
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
-        return;
-    CDataStream* pvMsg = mapOrphanTransactions[hash] = new CDataStream(vMsg);
+        return false;
+
+    // Big orphans could fill the pool with a handful of messages
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK);
+    if (nSize > MAX_ORPHAN_TX_SIZE)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
+
+    mapOrphanTransactions[hash] = tx;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev.insert(make_pair(txin.prevout.hash, pvMsg));
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    return true;
 }
 
 void EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    map<uint256, CTransaction>::iterator mi = mapOrphanTransactions.find(hash);
+    if (mi == mapOrphanTransactions.end())
         return;
-    const CDataStream* pvMsg = mapOrphanTransactions[hash];
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, (*mi).second.vin)
+    {
+        boost::unordered_map<COutPoint, set<uint256>, CSaltedHasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        (*itPrev).second.erase(hash);
+        if ((*itPrev).second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+    mapOrphanTransactions.erase(mi);
+}
+
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+{
+    // Evict at random so a flood can't predict what survives
+    unsigned int nEvicted = 0;
+    while (mapOrphanTransactions.size() > nMaxOrphans)
+    {
+        uint256 hashRandom;
+        RAND_bytes((unsigned char*)&hashRandom, sizeof(hashRandom));
+        map<uint256, CTransaction>::iterator mi = mapOrphanTransactions.lower_bound(hashRandom);
+        if (mi == mapOrphanTransactions.end())
+            mi = mapOrphanTransactions.begin();
+        EraseOrphanTx((*mi).first);
+        nEvicted++;
+    }
+    return nEvicted;
+}
+
+// Accepts every orphan waiting on txParent, then their children in turn,
+// so a whole chain of dependent payments goes in on one pass
+static void ProcessOrphanTransactions(const CTransaction& txParent)
+{
+    vector<CTransaction> vWorkQueue(1, txParent);
+    for (int i = 0; i < vWorkQueue.size(); i++)
     {
-        for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(txin.prevout.hash);
-             mi != mapOrphanTransactionsByPrev.upper_bound(txin.prevout.hash);)
+        uint256 hashPrev = vWorkQueue[i].GetHash();
+        set<uint256> setChildren;
+        for (unsigned int n = 0; n < vWorkQueue[i].vout.size(); n++)
         {
-            if ((*mi).second == pvMsg)
-                mapOrphanTransactionsByPrev.erase(mi++);
-            else
-                mi++;
+            boost::unordered_map<COutPoint, set<uint256>, CSaltedHasher>::iterator itPrev = mapOrphanTransactionsByPrev.find(COutPoint(hashPrev, n));
+            if (itPrev != mapOrphanTransactionsByPrev.end())
+                setChildren.insert((*itPrev).second.begin(), (*itPrev).second.end());
+        }
+
+        BOOST_FOREACH(const uint256& hash, setChildren)
+        {
+            map<uint256, CTransaction>::iterator mi = mapOrphanTransactions.find(hash);
+            if (mi == mapOrphanTransactions.end())
+                continue;
+            CTransaction tx = (*mi).second;
+            CInv inv(MSG_TX, hash);
+
+            bool fMissingInputs = false;
+            if (tx.AcceptToMemoryPool(true, &fMissingInputs))
+            {
+                printf("   accepted orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+                AddToWalletIfInvolvingMe(tx, NULL, true);
+                RelayMessage(inv, tx);
+                mapAlreadyAskedFor.erase(inv);
+                vWorkQueue.push_back(tx);
+                EraseOrphanTx(hash);
+            }
+            else if (!fMissingInputs)
+            {
+                // Invalid rather than still waiting on another parent
+                printf("   removed invalid orphan tx %s\n", hash.ToString().substr(0,10).c_str());
+                EraseOrphanTx(hash);
+            }
         }
     }
-    delete pvMsg;
-    mapOrphanTransactions.erase(hash);
 }
 
 
@@ -312,7 +377,7 @@ bool CTxIn::IsMine() const
 {
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
+        WalletMap::iterator mi = mapWallet.find(prevout.hash);
         if (mi != mapWallet.end())
         {
             const CWalletTx& prev = (*mi).second;
@@ -328,7 +393,7 @@ int64 CTxIn::GetDebit() const
 {
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
+        WalletMap::iterator mi = mapWallet.find(prevout.hash);
         if (mi != mapWallet.end())
         {
             const CWalletTx& prev = (*mi).second;
@@ -347,7 +412,7 @@ int64 CWalletTx::GetTxTime() const
         // If we did not receive the transaction directly, we rely on the block's
         // time to figure out when it happened.  We use the median over a range
         // of blocks to try to filter out inaccurate block times.
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -535,7 +600,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -721,14 +786,10 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     if (fCheckInputs)
     {
         // Check against previous transactions
-        map<uint256, CTxIndex> mapUnused;
+        map<uint256, CCoins> mapUnused;
         int64 nFees = 0;
-        if (!ConnectInputs(txdb, mapUnused, CDiskTxPos(1,1,1), pindexBest, nFees, false, false))
-        {
-            if (pfMissingInputs)
-                *pfMissingInputs = true;
+        if (!ConnectInputs(txdb, mapUnused, CDiskTxPos(1,1,1), pindexBest, nFees, false, false, 0, NULL, NULL, pfMissingInputs))
             return error("AcceptToMemoryPool() : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
-        }
 
         // Don't accept it if it can't get into a block
         if (nFees < GetMinFee(1000, true, true))
@@ -821,7 +882,7 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -913,7 +974,7 @@ void ReacceptWalletTransactions()
     while (fRepeat) CRITICAL_BLOCK(cs_mapWallet)
     {
         fRepeat = false;
-        vector<CDiskTxPos> vMissingTx;
+        bool fMissingTx = false;
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
         {
             CWalletTx& wtx = item.second;
@@ -924,21 +985,19 @@ void ReacceptWalletTransactions()
             bool fUpdated = false;
             if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %d != wtx.vout.size() %d\n", txindex.vSpent.size(), wtx.vout.size());
-                    continue;
-                }
-                for (int i = 0; i < txindex.vSpent.size(); i++)
+                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat,
+                // no coins record at all means every output is spent
+                CCoins coins;
+                txdb.ReadCoins(wtx.GetHash(), coins);
+                for (int i = 0; i < wtx.vout.size(); i++)
                 {
                     if (wtx.IsSpent(i))
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && wtx.vout[i].IsMine())
+                    if (!coins.IsAvailable(i) && wtx.vout[i].IsMine())
                     {
                         wtx.MarkSpent(i);
                         fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        fMissingTx = true;
                     }
                 }
                 if (fUpdated)
@@ -955,7 +1014,7 @@ void ReacceptWalletTransactions()
                     wtx.AcceptWalletTransaction(txdb, false);
             }
         }
-        if (!vMissingTx.empty())
+        if (fMissingTx)
         {
             // TODO: optimize this to scan just part of the block chain?
             if (ScanForWalletTransactions(pindexGenesisBlock))
@@ -1028,14 +1087,35 @@ void ResendWalletTransactions()
     }
 }
 
+int GetTxHeight(const CTxIndex& txindex)
+{
+    if (txindex.nHeight >= 0)
+        return txindex.nHeight;
+
+    // Older records don't have it, read block header
+    const CDiskTxPos& pos = txindex.pos;
+    CBlock block;
+    if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
+        return -1;
+    // Find the block in the index
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+    if (mi == mapBlockIndex.end())
+        return -1;
+    return (*mi).second->nHeight;
+}
+
 int CTxIndex::GetDepthInMainChain() const
 {
+    // The tx index only covers the main chain
+    if (nHeight >= 0)
+        return (nHeight <= nBestHeight ? 1 + nBestHeight - nHeight : 0);
+
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1105,9 +1185,7 @@ unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast)
         return pindexLast->nBits;
 
     // Go back by what we want to be 14 days worth of blocks
-    const CBlockIndex* pindexFirst = pindexLast;
-    for (int i = 0; pindexFirst && i < nInterval-1; i++)
-        pindexFirst = pindexFirst->pprev;
+    const CBlockIndex* pindexFirst = pindexLast->GetAncestor(pindexLast->nHeight - (nInterval-1));
     assert(pindexFirst);
 
     // Limit adjustment step
@@ -1169,15 +1247,15 @@ bool IsInitialBlockDownload()
 
 void InvalidChainFound(CBlockIndex* pindexNew)
 {
-    if (pindexNew->bnChainWork > bnBestInvalidWork)
+    if (pindexNew->nChainWork > nBestInvalidWork)
     {
-        bnBestInvalidWork = pindexNew->bnChainWork;
-        CTxDB().WriteBestInvalidWork(bnBestInvalidWork);
+        nBestInvalidWork = pindexNew->nChainWork;
+        CTxDB().WriteBestInvalidWork(nBestInvalidWork);
         MainFrameRepaint();
     }
-    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, pindexNew->bnChainWork.ToString().c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, CBigNum(pindexNew->nChainWork).ToString().c_str());
+    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainWork).ToString().c_str());
+    if (pindexBest && CBigNum(nBestInvalidWork) > CBigNum(nBestChainWork) + CBigNum(pindexBest->GetBlockWork()) * 6)
         printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
 }
 
@@ -1191,29 +1269,73 @@ void InvalidChainFound(CBlockIndex* pindexNew)
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+bool CTransaction::DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo)
 {
-    // Relinquish previous transactions' spent pointers
-    if (!IsCoinBase())
+    // Give back the previous transactions' outputs from the block's undo data
+    if (!IsCoinBase() && ptxundo)
+    {
+        if (ptxundo->vprevout.size() != vin.size())
+            return error("DisconnectInputs() : undo data doesn't match tx");
+
+        for (int i = vin.size()-1; i >= 0; i--)
+        {
+            COutPoint prevout = vin[i].prevout;
+            const CTxInUndo& undo = ptxundo->vprevout[i];
+
+            // The coins record is gone if this was its last unspent output
+            CCoins coins;
+            if (!txdb.ReadCoins(prevout.hash, coins))
+            {
+                coins.fCoinBase = undo.fCoinBase;
+                coins.nHeight = undo.nHeight;
+            }
+            if (prevout.n >= coins.vout.size())
+                coins.vout.resize(prevout.n + 1);
+
+            // Mark outpoint as not spent
+            coins.vout[prevout.n] = undo.txout;
+
+            // Write back
+            if (!txdb.WriteCoins(prevout.hash, coins))
+                return error("DisconnectInputs() : WriteCoins failed");
+        }
+    }
+    else if (!IsCoinBase())
     {
+        // No undo data, look the outputs up again
         BOOST_FOREACH(const CTxIn& txin, vin)
         {
             COutPoint prevout = txin.prevout;
 
-            // Get prev txindex from disk
+            // Get prev tx from disk
+            CTransaction txPrev;
             CTxIndex txindex;
-            if (!txdb.ReadTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : ReadTxIndex failed");
+            if (!txdb.ReadDiskTx(prevout.hash, txPrev, txindex))
+                return error("DisconnectInputs() : ReadDiskTx failed");
 
-            if (prevout.n >= txindex.vSpent.size())
+            if (prevout.n >= txPrev.vout.size())
                 return error("DisconnectInputs() : prevout.n out of range");
 
+            // The coins record is gone if this was its last unspent output
+            CCoins coins;
+            if (!txdb.ReadCoins(prevout.hash, coins))
+            {
+                int nHeight = GetTxHeight(txindex);
+                if (nHeight < 0)
+                    return error("DisconnectInputs() : prev tx block not found");
+                coins = CCoins(txPrev, nHeight);
+                BOOST_FOREACH(CTxOut& txout, coins.vout)
+                    txout.SetNull();
+            }
+            if (prevout.n >= coins.vout.size())
+                return error("DisconnectInputs() : prevout.n out of range of coins");
+
             // Mark outpoint as not spent
-            txindex.vSpent[prevout.n].SetNull();
+            coins.vout[prevout.n] = txPrev.vout[prevout.n];
 
             // Write back
-            if (!txdb.UpdateTxIndex(prevout.hash, txindex))
-                return error("DisconnectInputs() : UpdateTxIndex failed");
+            if (!txdb.WriteCoins(prevout.hash, coins))
+                return error("DisconnectInputs() : WriteCoins failed");
         }
     }
 
@@ -1225,10 +1347,11 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
 }
 
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee)
+bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CCoins>& mapTestPool, CDiskTxPos posThisTx,
+                                 CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee,
+                                 vector<CScriptCheck>* pvChecks, CTxUndo* ptxundo, bool* pfMissingInputs)
 {
-    // Take over previous transactions' spent pointers
+    // Spend previous transactions' unspent outputs
     if (!IsCoinBase())
     {
         int64 nValueIn = 0;
@@ -1236,77 +1359,77 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
         {
             COutPoint prevout = vin[i].prevout;
 
-            // Read txindex
-            CTxIndex txindex;
+            // Read coins
+            CCoins coins;
             bool fFound = true;
             if (fMiner && mapTestPool.count(prevout.hash))
             {
-                // Get txindex from current proposed changes
-                txindex = mapTestPool[prevout.hash];
+                // Get coins from current proposed changes
+                coins = mapTestPool[prevout.hash];
             }
             else
             {
-                // Read txindex from txdb
-                fFound = txdb.ReadTxIndex(prevout.hash, txindex);
+                // Read coins from txdb
+                fFound = txdb.ReadCoins(prevout.hash, coins);
             }
             if (!fFound && (fBlock || fMiner))
-                return fMiner ? false : error("ConnectInputs() : %s prev tx %s index entry not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s coins not found", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
 
-            // Read txPrev
-            CTransaction txPrev;
-            if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
+            if (!fFound)
             {
                 // Get prev tx from single transactions in memory
                 CRITICAL_BLOCK(cs_mapTransactions)
                 {
                     if (!mapTransactions.count(prevout.hash))
+                    {
+                        // Only this failure means we might get the input later
+                        if (pfMissingInputs)
+                            *pfMissingInputs = true;
                         return error("ConnectInputs() : %s mapTransactions prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                    txPrev = mapTransactions[prevout.hash];
+                    }
+                    coins = CCoins(mapTransactions[prevout.hash], pindexBlock->nHeight + 1);
                 }
-                if (!fFound)
-                    txindex.vSpent.resize(txPrev.vout.size());
-            }
-            else
-            {
-                // Get prev tx from disk
-                if (!txPrev.ReadFromDisk(txindex.pos))
-                    return error("ConnectInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
             }
 
-            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
-                return error("ConnectInputs() : %s prevout.n out of range %d %d %d prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str());
+            if (prevout.n >= coins.vout.size())
+                return error("ConnectInputs() : %s prevout.n out of range %d %d prev tx %s", GetHash().ToString().substr(0,10).c_str(), prevout.n, coins.vout.size(), prevout.hash.ToString().substr(0,10).c_str());
 
             // If prev is coinbase, check that it's matured
-            if (txPrev.IsCoinBase())
-                for (CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < COINBASE_MATURITY; pindex = pindex->pprev)
-                    if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
-                        return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - pindex->nHeight);
-
-            // Verify signature
-            if (!VerifySignature(txPrev, *this, i))
-                return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
+            if (coins.fCoinBase && pindexBlock->nHeight - coins.nHeight < COINBASE_MATURITY)
+                return error("ConnectInputs() : tried to spend coinbase at depth %d", pindexBlock->nHeight - coins.nHeight);
 
             // Check for conflicts
-            if (!txindex.vSpent[prevout.n].IsNull())
-                return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
+            if (coins.vout[prevout.n].IsNull())
+                return fMiner ? false : error("ConnectInputs() : %s prev tx %s output %d already used", GetHash().ToString().substr(0,10).c_str(), prevout.hash.ToString().substr(0,10).c_str(), prevout.n);
+
+            // Verify signature, or leave it for the caller to run in parallel
+            const CTxOut& txoutPrev = coins.vout[prevout.n];
+            if (pvChecks)
+                pvChecks->push_back(CScriptCheck(txoutPrev, *this, i));
+            else if (!VerifySignature(txoutPrev, *this, i))
+                return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
             // Check for negative or overflow input values
-            nValueIn += txPrev.vout[prevout.n].nValue;
-            if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += txoutPrev.nValue;
+            if (!MoneyRange(txoutPrev.nValue) || !MoneyRange(nValueIn))
                 return error("ConnectInputs() : txin values out of range");
 
-            // Mark outpoints as spent
-            txindex.vSpent[prevout.n] = posThisTx;
+            // Remember what is spent so it can be given back
+            if (ptxundo)
+                ptxundo->vprevout.push_back(CTxInUndo(txoutPrev, coins.fCoinBase, coins.nHeight));
+
+            // Mark outpoint as spent
+            coins.vout[prevout.n].SetNull();
 
             // Write back
             if (fBlock)
             {
-                if (!txdb.UpdateTxIndex(prevout.hash, txindex))
-                    return error("ConnectInputs() : UpdateTxIndex failed");
+                if (!txdb.WriteCoins(prevout.hash, coins))
+                    return error("ConnectInputs() : WriteCoins failed");
             }
             else if (fMiner)
             {
-                mapTestPool[prevout.hash] = txindex;
+                mapTestPool[prevout.hash] = coins;
             }
         }
 
@@ -1333,7 +1456,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPoo
     else if (fMiner)
     {
         // Add transaction to test pool
-        mapTestPool[GetHash()] = CTxIndex(CDiskTxPos(1,1,1), vout.size());
+        mapTestPool[GetHash()] = CCoins(*this, pindexBlock->nHeight + 1);
     }
 
     return true;
@@ -1388,11 +1511,138 @@ bool CTransaction::ClientConnectInputs()
 
 
 
+//
+// Script check threads
+//
+// ConnectBlock hands the block's script checks to RunScriptChecks, which
+// works on them together with the script check threads.  Callers hold
+// cs_main, so there is only ever one batch in flight.
+//
+
+static boost::mutex mutexScriptCheck;
+static boost::condition_variable condScriptCheckWork;
+static boost::condition_variable condScriptCheckDone;
+static vector<CScriptCheck>* pvScriptChecks = NULL;
+static unsigned int nScriptCheckNext = 0;
+static int nScriptCheckRunning = 0;
+static bool fScriptCheckFailed = false;
+static int nScriptCheckThreads = 0;
+
+// Claim and run checks from the current batch until it is used up.
+// Must be called with mutexScriptCheck held by lock.
+static void DoScriptChecks(boost::unique_lock<boost::mutex>& lock)
+{
+    while (pvScriptChecks && nScriptCheckNext < pvScriptChecks->size())
+    {
+        // Take a small run at a time so the threads finish together
+        vector<CScriptCheck>& vChecks = *pvScriptChecks;
+        unsigned int nBatch = max(1, min(16, (int)(vChecks.size() - nScriptCheckNext) / (2 * (nScriptCheckThreads + 1))));
+        unsigned int nBegin = nScriptCheckNext;
+        unsigned int nEnd = min((unsigned int)vChecks.size(), nBegin + nBatch);
+        nScriptCheckNext = nEnd;
+        nScriptCheckRunning++;
+        lock.unlock();
+
+        bool fOk = true;
+        for (unsigned int i = nBegin; i < nEnd && fOk; i++)
+            fOk = vChecks[i]();
+
+        lock.lock();
+        nScriptCheckRunning--;
+        if (!fOk)
+        {
+            // No point checking the rest of a bad block
+            fScriptCheckFailed = true;
+            nScriptCheckNext = vChecks.size();
+        }
+        if (nScriptCheckRunning == 0 && nScriptCheckNext >= vChecks.size())
+            condScriptCheckDone.notify_all();
+    }
+}
+
+void ThreadScriptCheck(void* parg)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    boost::unique_lock<boost::mutex> lock(mutexScriptCheck);
+    vnThreadsRunning[6]++;
+    while (!fShutdown)
+    {
+        DoScriptChecks(lock);
+        condScriptCheckWork.wait(lock);
+    }
+    vnThreadsRunning[6]--;
+}
+
+void WakeScriptCheckThreads()
+{
+    // Taking the lock means a thread can't miss the wakeup between looking
+    // at fShutdown and waiting
+    boost::lock_guard<boost::mutex> lock(mutexScriptCheck);
+    condScriptCheckWork.notify_all();
+}
+
+void StartScriptCheckThreads()
+{
+    // -par=<n> is the total number of threads checking scripts, including
+    // the one connecting the block
+    int nThreads = GetArg("-par", boost::thread::hardware_concurrency());
+    nThreads = max(1, min(nThreads, 16));
+    for (int i = 0; i < nThreads - 1; i++)
+    {
+        if (!CreateThread(ThreadScriptCheck, NULL))
+        {
+            printf("Error: CreateThread(ThreadScriptCheck) failed\n");
+            break;
+        }
+        nScriptCheckThreads++;
+    }
+    printf("Using %d threads for script verification\n", nScriptCheckThreads + 1);
+}
+
+bool RunScriptChecks(vector<CScriptCheck>& vChecks)
+{
+    if (nScriptCheckThreads == 0 || vChecks.size() < 2)
+    {
+        BOOST_FOREACH(const CScriptCheck& check, vChecks)
+            if (!check())
+                return false;
+        return true;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutexScriptCheck);
+    pvScriptChecks = &vChecks;
+    nScriptCheckNext = 0;
+    fScriptCheckFailed = false;
+    condScriptCheckWork.notify_all();
+
+    DoScriptChecks(lock);
+    while (nScriptCheckRunning > 0)
+        condScriptCheckDone.wait(lock);
+
+    pvScriptChecks = NULL;
+    return !fScriptCheckFailed;
+}
+
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Read what the block spent, blocks connected by older versions have none
+    CBlockUndo blockundo;
+    bool fUndo = false;
+    unsigned int nUndoFile, nUndoPos;
+    if (txdb.ReadBlockUndoPos(pindex->GetBlockHash(), nUndoFile, nUndoPos))
+    {
+        fUndo = (blockundo.ReadFromDisk(nUndoFile, nUndoPos, pindex->GetBlockHash()) &&
+                 blockundo.vtxundo.size() == vtx.size() - 1);
+        if (!fUndo)
+            printf("DisconnectBlock() : bad undo data for %s, looking up spent outputs instead\n", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+        if (!txdb.EraseBlockUndoPos(pindex->GetBlockHash()))
+            return error("DisconnectBlock() : EraseBlockUndoPos failed");
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+        if (!vtx[i].DisconnectInputs(txdb, (fUndo && i > 0) ? &blockundo.vtxundo[i-1] : NULL))
             return false;
 
     // Update block index on disk without changing it in memory.
@@ -1408,6 +1658,112 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+// Blocks the main chain is locked in to
+static const struct { int nHeight; const char* pszHash; } pCheckpoints[] =
+{
+    {  11111, "0x0000000069e244f73d78e8fd29ba2fd2ed618bd6fa2ee92559f542fdb26e7c1d" },
+    {  33333, "0x000000002dd5588a74784eaa7ab0507a18ad16a236e7b1ce69f00d7ddfb5d0a6" },
+    {  68555, "0x00000000001e1b4903550a0b96e9a9405c8a95f387162e4944e8d9fbe501cd6a" },
+    {  70567, "0x00000000006a49b14bcf27462068f1264c961f11fa2e0eddd2be0791e1d4124a" },
+    {  74000, "0x0000000000573993a3c9e41ce34471c079dcf5f52a0e824a81e7f953b8661a20" },
+    { 105000, "0x00000000000291ce28027faea320c8d2b054b2e0fe44a773f3eefb151d6bdc97" },
+    { 118000, "0x000000000000774a7f8a7a12dc906ddb9e17e75d684f15e00f8767f9e8f36553" },
+};
+
+bool CheckCheckpoint(int nHeight, const uint256& hash)
+{
+    for (int i = 0; i < ARRAYLEN(pCheckpoints); i++)
+        if (pCheckpoints[i].nHeight == nHeight)
+            return (hash == uint256(pCheckpoints[i].pszHash));
+    return true;
+}
+
+// Scripts in blocks buried under the -assumevalid block aren't checked.
+// Once that block is in the index its ancestors are found from there.
+// Before that, during the initial download, we go by the chain of headers
+// leading up to it, fetched with getheaders ahead of the blocks.  Each
+// header commits to the hash of the one before it, so a chain of them that
+// ends in the -assumevalid hash can only be that block's real ancestors.
+static CBlockIndex* pindexAssumeValidBase = NULL;
+static vector<uint256> vAssumeValidHeaders;
+static bool fAssumeValidHeadersDone = false;
+
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (fTestNet || hashAssumeValid == 0)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(hashAssumeValid);
+    if (mi != mapBlockIndex.end())
+        return ((*mi).second->GetAncestor(pindex->nHeight) == pindex);
+    if (!fAssumeValidHeadersDone)
+        return false;
+
+    // Headers follow on from a block we have, the base
+    if (pindex->nHeight <= pindexAssumeValidBase->nHeight)
+        return (pindexAssumeValidBase->GetAncestor(pindex->nHeight) == pindex);
+    unsigned int nPos = pindex->nHeight - pindexAssumeValidBase->nHeight - 1;
+    return (nPos < vAssumeValidHeaders.size() && vAssumeValidHeaders[nPos] == pindex->GetBlockHash());
+}
+
+static bool NeedAssumeValidHeaders()
+{
+    return (!fTestNet && hashAssumeValid != 0 && !fAssumeValidHeadersDone && !mapBlockIndex.count(hashAssumeValid));
+}
+
+static void PushGetAssumeValidHeaders(CNode* pnode)
+{
+    // Carry on from the last header we have, or start from our best block
+    vector<uint256> vHave;
+    if (!vAssumeValidHeaders.empty())
+    {
+        vHave.push_back(vAssumeValidHeaders.back());
+        vHave.push_back(pindexAssumeValidBase->GetBlockHash());
+        vHave.push_back(hashGenesisBlock);
+        pnode->PushMessage("getheaders", CBlockLocator(vHave), hashAssumeValid);
+    }
+    else
+        pnode->PushMessage("getheaders", CBlockLocator(pindexBest), hashAssumeValid);
+}
+
+// Add headers to the chain towards the -assumevalid block, returns true if
+// it got longer.  Headers that don't follow on from what we have are left.
+static bool AddAssumeValidHeaders(const vector<CBlock>& vHeaders)
+{
+    bool fGrew = false;
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        uint256 hash = header.GetHash();
+        if (!CheckProofOfWork(hash, header.nBits))
+            break;
+        if (!vAssumeValidHeaders.empty() && header.hashPrevBlock == vAssumeValidHeaders.back())
+        {
+            vAssumeValidHeaders.push_back(hash);
+        }
+        else
+        {
+            // Otherwise it starts a new chain from a block we have, if that's
+            // no shorter than the chain so far
+            BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+            if (mi == mapBlockIndex.end())
+                break;
+            if (pindexAssumeValidBase && (*mi).second->nHeight < pindexAssumeValidBase->nHeight + (int)vAssumeValidHeaders.size())
+                break;
+            pindexAssumeValidBase = (*mi).second;
+            vAssumeValidHeaders.assign(1, hash);
+        }
+        fGrew = true;
+
+        if (hash == hashAssumeValid)
+        {
+            printf("AddAssumeValidHeaders() : have headers up to the -assumevalid block at height %d\n",
+                   pindexAssumeValidBase->nHeight + (int)vAssumeValidHeaders.size());
+            fAssumeValidHeadersDone = true;
+            break;
+        }
+    }
+    return fGrew;
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     // Check it again in case a previous version let a bad block in
@@ -1417,20 +1773,40 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     //// issue here: it doesn't know the version
     unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK) - 1 + GetSizeOfCompactSize(vtx.size());
 
-    map<uint256, CTxIndex> mapUnused;
+    map<uint256, CCoins> mapUnused;
+    vector<CScriptCheck> vChecks;
+    CBlockUndo blockundo;
     int64 nFees = 0;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
-        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false))
+        CTxUndo txundo;
+        if (!tx.ConnectInputs(txdb, mapUnused, posThisTx, pindex, nFees, true, false, 0, &vChecks, &txundo))
             return false;
+        if (!tx.IsCoinBase())
+            blockundo.vtxundo.push_back(txundo);
     }
 
     if (vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return false;
 
+    // Spends and values were checked serially above, now do the signatures
+    if (!IsAssumedValid(pindex) && !RunScriptChecks(vChecks))
+        return error("ConnectBlock() : VerifySignature failed");
+
+    // VerifySignature would have done this for each input
+    BOOST_FOREACH(const CScriptCheck& check, vChecks)
+        WalletUpdateSpent(check.ptxTo->vin[check.nIn].prevout);
+
+    // Save what was spent for DisconnectBlock
+    unsigned int nUndoPos;
+    if (!blockundo.WriteToDisk(pindex->nFile, nUndoPos, pindex->GetBlockHash()))
+        return error("ConnectBlock() : WriteToDisk undo failed");
+    if (!txdb.WriteBlockUndoPos(pindex->GetBlockHash(), pindex->nFile, nUndoPos))
+        return error("ConnectBlock() : WriteBlockUndoPos failed");
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1457,8 +1833,8 @@ bool Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     CBlockIndex* plonger = pindexNew;
     while (pfork != plonger)
     {
-        while (plonger->nHeight > pfork->nHeight)
-            if (!(plonger = plonger->pprev))
+        if (plonger->nHeight > pfork->nHeight)
+            if (!(plonger = plonger->GetAncestor(pfork->nHeight)))
                 return error("Reorganize() : plonger->pprev is null");
         if (pfork == plonger)
             break;
@@ -1596,15 +1972,87 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
+    nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
+    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainWork).ToString().c_str());
 
     return true;
 }
 
 
+// Height that a block's skip pointer points back to.  Every other block skips
+// to a height with its lowest set bits cleared, which makes the jumps nest
+// like a skip list while keeping most of them short.
+static inline int InvertLowestOne(int n)
+{
+    return n & (n - 1);
+}
+
+static inline int GetSkipHeight(int nHeight)
+{
+    if (nHeight < 2)
+        return 0;
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn)
+{
+    if (nHeightIn > nHeight || nHeightIn < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (pindexWalk && nHeightWalk > nHeightIn)
+    {
+        // Take the skip unless it overshoots, or the one just behind it
+        // would get us there in fewer steps
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip && (nHeightSkip == nHeightIn ||
+            (nHeightSkip > nHeightIn && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightIn))))
+        {
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightIn) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightIn);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+// Block index entries live until shutdown, so they're carved out of large
+// chunks instead of each being its own heap allocation.  Caller holds cs_main
+// or is single threaded in LoadBlockIndex.
+void* AllocBlockIndex()
+{
+    static const unsigned int nChunkSize = 4096;
+    static char* pchunk = NULL;
+    static unsigned int nUsed = nChunkSize;
+    if (nUsed == nChunkSize)
+    {
+        pchunk = (char*)malloc(nChunkSize * sizeof(CBlockIndex));
+        if (!pchunk)
+            throw std::bad_alloc();
+        nUsed = 0;
+    }
+    return pchunk + sizeof(CBlockIndex) * nUsed++;
+}
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 {
     // Check for duplicate
@@ -1613,18 +2061,19 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
+    CBlockIndex* pindexNew = new (AllocBlockIndex()) CBlockIndex(nFile, nBlockPos, *this);
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->BuildSkip();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
 
     CTxDB txdb;
     txdb.TxnBegin();
@@ -1633,7 +2082,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return false;
 
     // New best
-    if (pindexNew->bnChainWork > bnBestChainWork)
+    if (pindexNew->nChainWork > nBestChainWork)
         if (!SetBestChain(txdb, pindexNew))
             return false;
 
@@ -1703,7 +2152,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return error("AcceptBlock() : prev block not found");
     CBlockIndex* pindexPrev = (*mi).second;
@@ -1724,13 +2173,7 @@ bool CBlock::AcceptBlock()
 
     // Check that the block chain matches the known block chain up to a checkpoint
     if (!fTestNet)
-        if ((nHeight ==  11111 && hash != uint256("0x0000000069e244f73d78e8fd29ba2fd2ed618bd6fa2ee92559f542fdb26e7c1d")) ||
-            (nHeight ==  33333 && hash != uint256("0x000000002dd5588a74784eaa7ab0507a18ad16a236e7b1ce69f00d7ddfb5d0a6")) ||
-            (nHeight ==  68555 && hash != uint256("0x00000000001e1b4903550a0b96e9a9405c8a95f387162e4944e8d9fbe501cd6a")) ||
-            (nHeight ==  70567 && hash != uint256("0x00000000006a49b14bcf27462068f1264c961f11fa2e0eddd2be0791e1d4124a")) ||
-            (nHeight ==  74000 && hash != uint256("0x0000000000573993a3c9e41ce34471c079dcf5f52a0e824a81e7f953b8661a20")) ||
-            (nHeight == 105000 && hash != uint256("0x00000000000291ce28027faea320c8d2b054b2e0fe44a773f3eefb151d6bdc97")) ||
-            (nHeight == 118000 && hash != uint256("0x000000000000774a7f8a7a12dc906ddb9e17e75d684f15e00f8767f9e8f36553")))
+        if (!CheckCheckpoint(nHeight, hash))
             return error("AcceptBlock() : rejected by checkpoint lockin at %d", nHeight);
 
     // Write block to history file
@@ -1891,60 +2334,270 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
-static unsigned int nCurrentBlockFile = 1;
-
-FILE* AppendBlockFile(unsigned int& nFileRet)
+FILE* OpenUndoFile(unsigned int nFile, unsigned int nUndoPos, const char* pszMode)
 {
-    nFileRet = 0;
-    loop
+    if (nFile == -1)
+        return NULL;
+    FILE* file = fopen(strprintf("%s/undo%04d.dat", GetDataDir().c_str(), nFile).c_str(), pszMode);
+    if (!file)
+        return NULL;
+    if (nUndoPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
     {
-        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
-        if (!file)
-            return NULL;
-        if (fseek(file, 0, SEEK_END) != 0)
-            return NULL;
-        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < 0x7F000000 - MAX_SIZE)
+        if (fseek(file, nUndoPos, SEEK_SET) != 0)
         {
-            nFileRet = nCurrentBlockFile;
-            return file;
+            fclose(file);
+            return NULL;
         }
-        fclose(file);
-        nCurrentBlockFile++;
     }
+    return file;
 }
 
-bool LoadBlockIndex(bool fAllowNew)
+//
+// Block file reads
+//
+// Descriptors for the block files are opened once and shared, and reads use
+// pread so threads never have to seek or reopen.  There are only ever a few
+// block files since each grows to nearly 2GB, so they're kept until exit.
+//
+// With -mmapblocks on 64-bit systems each file is also mapped in full up to
+// the 2GB limit, and reads are copied out of the mapping.  The mapping never
+// moves, so it keeps working as AppendBlockFile extends the file; we only
+// have to refresh the file size before touching pages past the known end.
+//
+
+static const unsigned int MAX_BLOCKFILE_SIZE = 0x7F000000;
+
+#ifndef __WXMSW__
+class CBlockFile
 {
-    if (fTestNet)
-    {
-        hashGenesisBlock = uint256("0x00000007199508e34a9ff81e6ec0c477a4cccff2a4767a8eee39c11db367b008");
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
-        pchMessageStart[0] = 0xfa;
-        pchMessageStart[1] = 0xbf;
-        pchMessageStart[2] = 0xb5;
-        pchMessageStart[3] = 0xda;
-    }
+public:
+    int fd;
+    const char* pMap;
+    unsigned int nFileSize;
+};
 
-    //
-    // Load block index
-    //
-    CTxDB txdb("cr");
-    if (!txdb.LoadBlockIndex())
-        return false;
-    txdb.Close();
+static CCriticalSection cs_mapBlockFile;
+static map<unsigned int, CBlockFile> mapBlockFile;
 
-    //
-    // Init with genesis block
-    //
-    if (mapBlockIndex.empty())
+static bool GetBlockFile(unsigned int nFile, unsigned int nEnd, CBlockFile& fileRet)
+{
+    CRITICAL_BLOCK(cs_mapBlockFile)
     {
-        if (!fAllowNew)
-            return false;
-
-        // Genesis Block:
-        // CBlock(hash=000000000019d6, ver=1, hashPrevBlock=00000000000000, hashMerkleRoot=4a5e1e, nTime=1231006505, nBits=1d00ffff, nNonce=2083236893, vtx=1)
-        //   CTransaction(hash=4a5e1e, ver=1, vin.size=1, vout.size=1, nLockTime=0)
+        map<unsigned int, CBlockFile>::iterator mi = mapBlockFile.find(nFile);
+        if (mi == mapBlockFile.end())
+        {
+            CBlockFile file;
+            file.fd = open(strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile).c_str(), O_RDONLY);
+            if (file.fd == -1)
+                return false;
+            file.pMap = NULL;
+            file.nFileSize = 0;
+            if (sizeof(void*) >= 8 && GetBoolArg("-mmapblocks"))
+            {
+                void* p = mmap(NULL, MAX_BLOCKFILE_SIZE, PROT_READ, MAP_SHARED, file.fd, 0);
+                if (p != MAP_FAILED)
+                    file.pMap = (const char*)p;
+            }
+            mi = mapBlockFile.insert(make_pair(nFile, file)).first;
+        }
+
+        // Only mapped pages inside the file are safe to touch
+        CBlockFile& file = (*mi).second;
+        if (file.pMap && nEnd > file.nFileSize)
+        {
+            struct stat st;
+            if (fstat(file.fd, &st) == 0)
+                file.nFileSize = min((int64)st.st_size, (int64)MAX_BLOCKFILE_SIZE);
+        }
+        fileRet = file;
+    }
+    return true;
+}
+
+// Hint that the bytes after nPos are about to be read, so sequential scans
+// and block serving don't stall on each page
+static void ReadAheadBlockFile(const CBlockFile& file, unsigned int nPos, unsigned int nSize)
+{
+    if (!file.pMap || nPos >= file.nFileSize)
+        return;
+    static unsigned int nPageSize = sysconf(_SC_PAGESIZE);
+    unsigned int nBegin = nPos - nPos % nPageSize;
+    unsigned int nEnd = min(nPos + nSize, file.nFileSize);
+    madvise((void*)(file.pMap + nBegin), nEnd - nBegin, MADV_WILLNEED);
+}
+#endif
+
+// Read up to nSize bytes at nPos, returns the number read (less only at the
+// end of the file) or -1 on error
+int ReadBlockFile(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize)
+{
+    if (nFile == -1)
+        return -1;
+#ifdef __WXMSW__
+    CAutoFile filein = OpenBlockFile(nFile, nPos, "rb");
+    if (!filein)
+        return -1;
+    return fread(pch, 1, nSize, filein);
+#else
+    CBlockFile file;
+    if (!GetBlockFile(nFile, nPos + nSize, file))
+        return -1;
+    if (file.pMap)
+    {
+        if (nPos >= file.nFileSize)
+            return 0;
+        unsigned int nRead = min(nSize, file.nFileSize - nPos);
+        memcpy(pch, file.pMap + nPos, nRead);
+        return nRead;
+    }
+    int fd = file.fd;
+    unsigned int nRead = 0;
+    while (nRead < nSize)
+    {
+        int n = pread(fd, pch + nRead, nSize - nRead, nPos + nRead);
+        if (n == 0)
+            break;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        nRead += n;
+    }
+    return nRead;
+#endif
+}
+
+// Size of the block at nBlockPos, from the index header written in front of it
+bool ReadBlockSize(unsigned int nFile, unsigned int nBlockPos, unsigned int& nSizeRet)
+{
+    nSizeRet = 0;
+    if (nBlockPos < sizeof(nSizeRet) || ReadBlockFile(nFile, nBlockPos - sizeof(nSizeRet), (char*)&nSizeRet, sizeof(nSizeRet)) != sizeof(nSizeRet))
+        return error("ReadBlockSize() : read failed");
+    if (nSizeRet > MAX_SIZE)
+        return error("ReadBlockSize() : bad block size %u", nSizeRet);
+    return true;
+}
+
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet)
+{
+    unsigned int nSize;
+    if (!ReadBlockSize(nFile, nBlockPos, nSize))
+        return false;
+    ssRet.clear();
+    ssRet.resize(nSize);
+    if (nSize > 0 && ReadBlockFile(nFile, nBlockPos, &ssRet[0], nSize) != nSize)
+        return error("ReadRawBlockFromDisk() : read failed");
+
+#ifndef __WXMSW__
+    // Whoever reads this block usually wants the next one too
+    CBlockFile file;
+    if (GetBlockFile(nFile, 0, file))
+        ReadAheadBlockFile(file, nBlockPos + nSize, MAX_BLOCK_SIZE);
+#endif
+    return true;
+}
+
+// Each thread keeps one buffer for block and transaction reads, so its
+// allocation is reused instead of made again on every read.  A block is the
+// most it's kept at; if a read needed more, the memory is given back.
+static boost::thread_specific_ptr<CDataStream> pssReadBuffer;
+
+CDataStream& GetReadBuffer()
+{
+    CDataStream* pss = pssReadBuffer.get();
+    if (!pss || pss->capacity() > MAX_BLOCK_SIZE + 0x10000)
+    {
+        pss = new CDataStream(SER_DISK);
+        pssReadBuffer.reset(pss);
+    }
+    pss->clear();
+    pss->Init(SER_DISK);
+    return *pss;
+}
+
+bool ReadTxFromDisk(const CDiskTxPos& pos, CTransaction& tx)
+{
+    // Most transactions fit in the first small read, otherwise retry bigger
+    for (unsigned int nSize = 1024; ; nSize *= 8)
+    {
+        CDataStream& ss = GetReadBuffer();
+        ss.resize(nSize);
+        int nRead = ReadBlockFile(pos.nFile, pos.nTxPos, &ss[0], nSize);
+        if (nRead <= 0)
+            return error("ReadTxFromDisk() : read failed");
+        ss.resize(nRead);
+        try
+        {
+            ss >> tx;
+            return true;
+        }
+        catch (std::exception& e)
+        {
+            if (nRead < nSize || nSize >= MAX_SIZE)
+                return error("ReadTxFromDisk() : %s", e.what());
+        }
+    }
+}
+
+static unsigned int nCurrentBlockFile = 1;
+
+FILE* AppendBlockFile(unsigned int& nFileRet)
+{
+    nFileRet = 0;
+    loop
+    {
+        FILE* file = OpenBlockFile(nCurrentBlockFile, 0, "ab");
+        if (!file)
+            return NULL;
+        if (fseek(file, 0, SEEK_END) != 0)
+            return NULL;
+        // FAT32 filesize max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
+        if (ftell(file) < MAX_BLOCKFILE_SIZE - MAX_SIZE)
+        {
+            nFileRet = nCurrentBlockFile;
+            return file;
+        }
+        fclose(file);
+        nCurrentBlockFile++;
+    }
+}
+
+bool LoadBlockIndex(bool fAllowNew)
+{
+    if (fTestNet)
+    {
+        hashGenesisBlock = uint256("0x00000007199508e34a9ff81e6ec0c477a4cccff2a4767a8eee39c11db367b008");
+        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 28);
+        pchMessageStart[0] = 0xfa;
+        pchMessageStart[1] = 0xbf;
+        pchMessageStart[2] = 0xb5;
+        pchMessageStart[3] = 0xda;
+    }
+
+    if (mapArgs.count("-assumevalid"))
+        hashAssumeValid.SetHex(mapArgs["-assumevalid"]);
+
+    //
+    // Load block index
+    //
+    CTxDB txdb("cr");
+    if (!txdb.LoadBlockIndex())
+        return false;
+    txdb.Close();
+
+    //
+    // Init with genesis block
+    //
+    if (mapBlockIndex.empty())
+    {
+        if (!fAllowNew)
+            return false;
+
+        // Genesis Block:
+        // CBlock(hash=000000000019d6, ver=1, hashPrevBlock=00000000000000, hashMerkleRoot=4a5e1e, nTime=1231006505, nBits=1d00ffff, nNonce=2083236893, vtx=1)
+        //   CTransaction(hash=4a5e1e, ver=1, vin.size=1, vout.size=1, nLockTime=0)
         //     CTxIn(COutPoint(000000, -1), coinbase 04ffff001d0104455468652054696d65732030332f4a616e2f32303039204368616e63656c6c6f72206f6e206272696e6b206f66207365636f6e64206261696c6f757420666f722062616e6b73)
         //     CTxOut(nValue=50.00000000, scriptPubKey=0x5F1DF16B2B704C8A578D0B)
         //   vMerkleTree: 4a5e1e
@@ -1999,7 +2652,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2109,7 +2762,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    if (pindexBest && CBigNum(nBestInvalidWork) > CBigNum(nBestChainWork) + CBigNum(pindexBest->GetBlockWork()) * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = "WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.";
@@ -2217,13 +2870,27 @@ bool AlreadyHave(CTxDB& txdb, const CInv& inv)
 char pchMessageStart[4] = { 0xf9, 0xbe, 0xb4, 0xd9 };
 
 
+static void ProcessGetData(CNode* pfrom);
+
+// Message handlers run in several threads.  Anything that reads or changes
+// the chain, the wallet or other peers' state is serialized under cs_main;
+// these commands only touch pfrom, or take cs_main themselves once the
+// message has been decoded.
+// These handlers take cs_main themselves around the parts that touch the
+// chain or the memory pool, or don't need it at all, the rest run under it
+static bool MessageNeedsMainLock(const string& strCommand)
+{
+    if (strCommand == "verack" || strCommand == "addr" || strCommand == "inv" ||
+        strCommand == "getdata" || strCommand == "tx" || strCommand == "block" ||
+        strCommand == "sendcmpct" || strCommand == "getaddr" || strCommand == "ping")
+        return false;
+    return true;
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%u messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -2233,73 +2900,49 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    // The socket thread has already framed these, see CNode::ReceiveMsgBytes
+    //
 
-    loop
+    // Finish the getdata we were answering before reading anything newer,
+    // and leave the peer's messages alone while its send queue is full
+    if (!pfrom->vRecvGetData.empty())
+        CRITICAL_BLOCK(cs_main)
+            ProcessGetData(pfrom);
+
+    while (!pfrom->vRecvMsg.empty() && pfrom->vRecvMsg.front().IsComplete())
     {
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if (vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        if (!pfrom->vRecvGetData.empty() || pfrom->IsSendQueueFull())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %d BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
 
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        CMessageHeader& hdr = msg.hdr;
         string strCommand = hdr.GetCommand();
-
-        // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessage(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
-            break;
-        }
 
         // Checksum
-        if (vRecv.GetVersion() >= 209)
+        if (msg.hdrbuf.GetVersion() >= 209)
         {
-            uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-            unsigned int nChecksum = 0;
-            memcpy(&nChecksum, &hash, sizeof(nChecksum));
+            unsigned int nChecksum = msg.GetChecksum();
             if (nChecksum != hdr.nChecksum)
             {
                 printf("ProcessMessage(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
                        strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+                pfrom->vRecvMsg.pop_front();
                 continue;
             }
         }
-
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
+        CDataStream& vMsg = msg.vRecv;
 
         // Process message
         bool fRet = false;
         try
         {
-            CRITICAL_BLOCK(cs_main)
+            if (MessageNeedsMainLock(strCommand))
+            {
+                CRITICAL_BLOCK(cs_main)
+                    fRet = ProcessMessage(pfrom, strCommand, vMsg);
+            }
+            else
                 fRet = ProcessMessage(pfrom, strCommand, vMsg);
             if (fShutdown)
                 return true;
@@ -2329,15 +2972,256 @@ bool ProcessMessages(CNode* pfrom)
 
         if (!fRet)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        pfrom->vRecvMsg.pop_front();
     }
 
-    vRecv.Compact();
     return true;
 }
 
 
 
 
+//
+// Raw block cache
+//
+// Serialized copies of recently requested blocks, most recent first.  A new
+// block is asked for by nearly every peer within seconds, so it's kept
+// around instead of going back to the block file each time.
+//
+
+typedef boost::shared_ptr<vector<char> > CRawBlockPtr;
+
+static CCriticalSection cs_RawBlockCache;
+static list<pair<uint256, CRawBlockPtr> > listRawBlockCache;
+static map<uint256, list<pair<uint256, CRawBlockPtr> >::iterator> mapRawBlockCache;
+static int64 nRawBlockCacheBytes = 0;
+static int64 nRawBlockCacheHits = 0;
+static int64 nRawBlockCacheMisses = 0;
+
+static CRawBlockPtr GetRawBlock(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    CRITICAL_BLOCK(cs_RawBlockCache)
+    {
+        map<uint256, list<pair<uint256, CRawBlockPtr> >::iterator>::iterator mi = mapRawBlockCache.find(hash);
+        if (mi != mapRawBlockCache.end())
+        {
+            nRawBlockCacheHits++;
+            listRawBlockCache.splice(listRawBlockCache.begin(), listRawBlockCache, (*mi).second);
+            return (*(*mi).second).second;
+        }
+        nRawBlockCacheMisses++;
+    }
+
+    // Read it without holding the lock
+    unsigned int nSize;
+    if (!ReadBlockSize(pindex->nFile, pindex->nBlockPos, nSize))
+        return CRawBlockPtr();
+    CRawBlockPtr pblock(new vector<char>(nSize));
+    if (nSize > 0 && ReadBlockFile(pindex->nFile, pindex->nBlockPos, &(*pblock)[0], nSize) != nSize)
+    {
+        error("GetRawBlock() : ReadBlockFile failed");
+        return CRawBlockPtr();
+    }
+
+    int64 nMaxBytes = GetArg("-blockcachesize", 8) * 1000000;
+    CRITICAL_BLOCK(cs_RawBlockCache)
+    {
+        if (nMaxBytes > 0 && !mapRawBlockCache.count(hash))
+        {
+            listRawBlockCache.push_front(make_pair(hash, pblock));
+            mapRawBlockCache[hash] = listRawBlockCache.begin();
+            nRawBlockCacheBytes += nSize;
+            while (nRawBlockCacheBytes > nMaxBytes && !listRawBlockCache.empty())
+            {
+                nRawBlockCacheBytes -= listRawBlockCache.back().second->size();
+                mapRawBlockCache.erase(listRawBlockCache.back().first);
+                listRawBlockCache.pop_back();
+            }
+        }
+    }
+    return pblock;
+}
+
+void GetRawBlockCacheStats(int64& nHits, int64& nMisses, int& nBlocks, int64& nBytes)
+{
+    CRITICAL_BLOCK(cs_RawBlockCache)
+    {
+        nHits = nRawBlockCacheHits;
+        nMisses = nRawBlockCacheMisses;
+        nBlocks = mapRawBlockCache.size();
+        nBytes = nRawBlockCacheBytes;
+    }
+}
+
+// Send a block's stored bytes as they are instead of deserializing and
+// reserializing it
+static bool PushRawBlock(CNode* pnode, const CBlockIndex* pindex)
+{
+    CRawBlockPtr pblock = GetRawBlock(pindex);
+    if (!pblock || pblock->empty())
+        return false;
+    pnode->BeginMessage("block");
+    try
+    {
+        pnode->vSend.write(&(*pblock)[0], pblock->size());
+    }
+    catch (...)
+    {
+        pnode->AbortMessage();
+        throw;
+    }
+    pnode->EndMessage();
+    return true;
+}
+
+static bool ReadCachedBlock(const CBlockIndex* pindex, CBlock& block)
+{
+    CRawBlockPtr pblock = GetRawBlock(pindex);
+    if (!pblock || pblock->empty())
+        return false;
+    try {
+        CDataStream(*pblock, SER_DISK) >> block;
+    }
+    catch (std::exception &e) {
+        return error("ReadCachedBlock() : deserialize or I/O error");
+    }
+    return true;
+}
+
+
+
+
+//
+// Compact blocks
+//
+
+// Blocks waiting for the transactions we asked for with getblocktxn
+class CPartialBlock
+{
+public:
+    CBlock block;
+    vector<unsigned int> vMissing;
+    int64 nTime;
+    int64 nNodeId;  // the peer we asked with getblocktxn
+};
+
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static map<uint256, CPartialBlock> mapPartialBlocks;
+
+// Rebuild the block from the memory pool, vMissing gets the positions
+// of the transactions we couldn't find
+static void FillCompactBlock(const CCompactBlock& cmpctblock, CBlock& block, vector<unsigned int>& vMissing)
+{
+    block = cmpctblock.header;
+    block.vtx.resize(cmpctblock.vShortID.size() + 1);
+    block.vtx[0] = cmpctblock.txCoinbase;
+    vMissing.clear();
+
+    uint64 k0, k1;
+    cmpctblock.GetShortIDKeys(k0, k1);
+    map<uint64, const CTransaction*> mapShortID;
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        for (TxMap::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        {
+            // If two pool transactions share an ID, fetch it rather than guess
+            pair<map<uint64, const CTransaction*>::iterator, bool> ret;
+            ret = mapShortID.insert(make_pair(CCompactBlock::GetShortID((*mi).first, k0, k1), &(*mi).second));
+            if (!ret.second)
+                (*ret.first).second = NULL;
+        }
+
+        for (unsigned int i = 0; i < cmpctblock.vShortID.size(); i++)
+        {
+            map<uint64, const CTransaction*>::iterator mi = mapShortID.find(cmpctblock.vShortID[i]);
+            if (mi != mapShortID.end() && (*mi).second)
+                block.vtx[i + 1] = *(*mi).second;
+            else
+                vMissing.push_back(i + 1);
+        }
+    }
+}
+
+// A short ID can still match the wrong transaction, the merkle root
+// catches that and we fall back to asking for the whole block
+static bool ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s didn't rebuild, asking for the full block\n", inv.hash.ToString().substr(0,20).c_str());
+        pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+        return true;
+    }
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    return true;
+}
+
+// Answer queued getdata requests until the peer's send queue fills up,
+// the rest wait until the socket thread has drained it
+static void ProcessGetData(CNode* pfrom)
+{
+    while (!pfrom->vRecvGetData.empty() && !pfrom->IsSendQueueFull())
+    {
+        if (fShutdown)
+            return;
+        const CInv inv = pfrom->vRecvGetData.front();
+        pfrom->vRecvGetData.pop_front();
+        printf("received getdata for: %s\n", inv.ToString().c_str());
+
+        if (inv.type == MSG_BLOCK)
+        {
+            // Send block from disk
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+            if (mi != mapBlockIndex.end())
+            {
+                PushRawBlock(pfrom, (*mi).second);
+
+                // Trigger them to send a getblocks request for the next batch of inventory
+                if (inv.hash == pfrom->hashContinue)
+                {
+                    // Bypass PushInventory, this must send even if redundant,
+                    // and we want it right after the last block so they don't
+                    // wait for other stuff first.  It goes in the bulk queue
+                    // so it can't overtake the blocks still waiting there.
+                    vector<CInv> vInv;
+                    vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                    pfrom->PushMessageClass(SEND_BULK, "inv", vInv);
+                    pfrom->hashContinue = 0;
+                }
+            }
+        }
+        else if (inv.type == MSG_CMPCT_BLOCK)
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+            CBlock block;
+            if (mi != mapBlockIndex.end() && ReadCachedBlock((*mi).second, block))
+                pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+        }
+        else if (inv.IsKnownType())
+        {
+            // Send stream from relay memory
+            CRITICAL_BLOCK(cs_mapRelay)
+            {
+                boost::unordered_map<CInv, CDataStream, CSaltedHasher>::iterator mi = mapRelay.find(inv);
+                if (mi != mapRelay.end())
+                    pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+            }
+        }
+
+        // Track requests for our stuff
+        CRITICAL_BLOCK(cs_mapRequestCount)
+        {
+            map<uint256, int>::iterator mi = mapRequestCount.find(inv.hash);
+            if (mi != mapRequestCount.end())
+                (*mi).second++;
+        }
+    }
+}
+
 bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     static map<unsigned int, vector<unsigned char> > mapReuseKey;
@@ -2399,7 +3283,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->PushMessage("verack");
         pfrom->vSend.SetVersion(min(pfrom->nVersion, VERSION));
         if (pfrom->nVersion < 209)
-            pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+            pfrom->nRecvVersion = min(pfrom->nVersion, VERSION);
 
         if (!pfrom->fInbound)
         {
@@ -2412,13 +3296,20 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             }
 
             // Get recent addresses
-            if (pfrom->nVersion >= 31402 || mapAddresses.size() < 1000)
+            if (pfrom->nVersion >= 31402 || addrman.size() < 1000)
             {
                 pfrom->PushMessage("getaddr");
                 pfrom->fGetAddr = true;
             }
+
+            // It answered, so it moves to the tried table
+            addrman.Good(pfrom->addr);
         }
 
+        // Get the headers up to the -assumevalid block ahead of the blocks
+        if (!pfrom->fClient && NeedAssumeValidHeaders())
+            PushGetAssumeValidHeaders(pfrom);
+
         // Ask the first connected node for block updates
         static int nAskedForBlocks;
         if (!pfrom->fClient && (nAskedForBlocks < 1 || vNodes.size() <= 1))
@@ -2432,6 +3323,10 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
                 item.second.RelayTo(pfrom);
 
+        // We can serve blocks as cmpctblock
+        if (pfrom->nVersion >= 209)
+            pfrom->PushMessage("sendcmpct");
+
         pfrom->fSuccessfullyConnected = true;
 
         printf("version message: version %d, blocks=%d\n", pfrom->nVersion, pfrom->nStartingHeight);
@@ -2447,7 +3342,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, VERSION));
+        pfrom->nRecvVersion = min(pfrom->nVersion, VERSION);
     }
 
 
@@ -2459,7 +3354,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         // Don't want addr from older versions unless seeding
         if (pfrom->nVersion < 209)
             return true;
-        if (pfrom->nVersion < 31402 && mapAddresses.size() > 1000)
+        if (pfrom->nVersion < 31402 && addrman.size() > 1000)
             return true;
         if (vAddr.size() > 1000)
             return error("message addr size() = %d", vAddr.size());
@@ -2476,7 +3371,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 continue;
             if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
                 addr.nTime = nNow - 5 * 24 * 60 * 60;
-            AddAddress(addr, 2 * 60 * 60);
+            AddAddress(addr, 2 * 60 * 60, pfrom->addr);
             pfrom->AddAddressKnown(addr);
             if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
             {
@@ -2484,7 +3379,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 CRITICAL_BLOCK(cs_vNodes)
                 {
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the filterAddrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         RAND_bytes((unsigned char*)&hashSalt, sizeof(hashSalt));
@@ -2519,27 +3414,30 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (vInv.size() > 50000)
             return error("message inv size() = %d", vInv.size());
 
-        CTxDB txdb("r");
-        BOOST_FOREACH(const CInv& inv, vInv)
+        CRITICAL_BLOCK(cs_main)
         {
-            if (fShutdown)
-                return true;
-            pfrom->AddInventoryKnown(inv);
+            CTxDB txdb("r");
+            BOOST_FOREACH(const CInv& inv, vInv)
+            {
+                if (fShutdown)
+                    return true;
+                pfrom->AddInventoryKnown(inv);
 
-            bool fAlreadyHave = AlreadyHave(txdb, inv);
-            printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+                bool fAlreadyHave = AlreadyHave(txdb, inv);
+                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
-                pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                if (!fAlreadyHave)
+                    pfrom->AskFor(inv);
+                else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash))
+                    pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
 
-            // Track requests for our stuff
-            CRITICAL_BLOCK(cs_mapRequestCount)
-            {
-                map<uint256, int>::iterator mi = mapRequestCount.find(inv.hash);
-                if (mi != mapRequestCount.end())
-                    (*mi).second++;
+                // Track requests for our stuff
+                CRITICAL_BLOCK(cs_mapRequestCount)
+                {
+                    map<uint256, int>::iterator mi = mapRequestCount.find(inv.hash);
+                    if (mi != mapRequestCount.end())
+                        (*mi).second++;
+                }
             }
         }
     }
@@ -2552,54 +3450,9 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (vInv.size() > 50000)
             return error("message getdata size() = %d", vInv.size());
 
-        BOOST_FOREACH(const CInv& inv, vInv)
-        {
-            if (fShutdown)
-                return true;
-            printf("received getdata for: %s\n", inv.ToString().c_str());
-
-            if (inv.type == MSG_BLOCK)
-            {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // Bypass PushInventory, this must send even if redundant,
-                        // and we want it right after the last block so they don't
-                        // wait for other stuff first.
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
-            }
-            else if (inv.IsKnownType())
-            {
-                // Send stream from relay memory
-                CRITICAL_BLOCK(cs_mapRelay)
-                {
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end())
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                }
-            }
-
-            // Track requests for our stuff
-            CRITICAL_BLOCK(cs_mapRequestCount)
-            {
-                map<uint256, int>::iterator mi = mapRequestCount.find(inv.hash);
-                if (mi != mapRequestCount.end())
-                    (*mi).second++;
-            }
-        }
+        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+        CRITICAL_BLOCK(cs_main)
+            ProcessGetData(pfrom);
     }
 
 
@@ -2647,7 +3500,7 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -2673,9 +3526,20 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+
+        // Keep asking the same node while it has more
+        if (NeedAssumeValidHeaders() && AddAssumeValidHeaders(vHeaders) &&
+            NeedAssumeValidHeaders() && vHeaders.size() >= 2000)
+            PushGetAssumeValidHeaders(pfrom);
+    }
+
+
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
         CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
@@ -2683,45 +3547,27 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        if (tx.AcceptToMemoryPool(true, &fMissingInputs))
+        CRITICAL_BLOCK(cs_main)
         {
-            AddToWalletIfInvolvingMe(tx, NULL, true);
-            RelayMessage(inv, vMsg);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-
-            // Recursively process any orphan transactions that depended on this one
-            for (int i = 0; i < vWorkQueue.size(); i++)
+            bool fMissingInputs = false;
+            if (tx.AcceptToMemoryPool(true, &fMissingInputs))
             {
-                uint256 hashPrev = vWorkQueue[i];
-                for (multimap<uint256, CDataStream*>::iterator mi = mapOrphanTransactionsByPrev.lower_bound(hashPrev);
-                     mi != mapOrphanTransactionsByPrev.upper_bound(hashPrev);
-                     ++mi)
-                {
-                    const CDataStream& vMsg = *((*mi).second);
-                    CTransaction tx;
-                    CDataStream(vMsg) >> tx;
-                    CInv inv(MSG_TX, tx.GetHash());
+                AddToWalletIfInvolvingMe(tx, NULL, true);
+                RelayMessage(inv, vMsg);
+                mapAlreadyAskedFor.erase(inv);
 
-                    if (tx.AcceptToMemoryPool(true))
-                    {
-                        printf("   accepted orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-                        AddToWalletIfInvolvingMe(tx, NULL, true);
-                        RelayMessage(inv, vMsg);
-                        mapAlreadyAskedFor.erase(inv);
-                        vWorkQueue.push_back(inv.hash);
-                    }
-                }
+                // Process any orphan transactions that depended on this one
+                ProcessOrphanTransactions(tx);
             }
+            else if (fMissingInputs)
+            {
+                printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
+                AddOrphanTx(tx);
 
-            BOOST_FOREACH(uint256 hash, vWorkQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            printf("storing orphan tx %s\n", inv.hash.ToString().substr(0,10).c_str());
-            AddOrphanTx(vMsg);
+                unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+                if (nEvicted > 0)
+                    printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+            }
         }
     }
 
@@ -2734,35 +3580,125 @@ bool ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
         // block.print();
 
+        // Decoding and hashing above run outside cs_main
         CInv inv(MSG_BLOCK, block.GetHash());
+        CRITICAL_BLOCK(cs_main)
+        {
+            pfrom->AddInventoryKnown(inv);
+
+            if (ProcessBlock(pfrom, &block))
+                mapAlreadyAskedFor.erase(inv);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        pfrom->fCompactBlocks = true;
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+        if (cmpctblock.vShortID.size() > MAX_BLOCK_SIZE / 60)
+            return error("message cmpctblock size() = %d", cmpctblock.vShortID.size());
+
+        uint256 hash = cmpctblock.GetHash();
+        CInv inv(MSG_BLOCK, hash);
         pfrom->AddInventoryKnown(inv);
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash) || mapPartialBlocks.count(hash))
+            return true;
+        if (!CheckProofOfWork(hash, cmpctblock.header.nBits))
+            return error("message cmpctblock : proof of work failed");
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
+        CBlock block;
+        vector<unsigned int> vMissing;
+        FillCompactBlock(cmpctblock, block, vMissing);
+        printf("received compact block %s, missing %d of %d transactions\n", hash.ToString().substr(0,20).c_str(), vMissing.size(), block.vtx.size());
+        if (vMissing.empty())
+            return ProcessCompactBlock(pfrom, block);
+
+        // Forget blocks whose transactions never came
+        for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end();)
+        {
+            if ((*mi).second.nTime < GetTime() - 2 * 60)
+                mapPartialBlocks.erase(mi++);
+            else
+                mi++;
+        }
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+        {
+            pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+            return true;
+        }
+
+        CPartialBlock& partial = mapPartialBlocks[hash];
+        partial.block = block;
+        partial.vMissing = vMissing;
+        partial.nTime = GetTime();
+        partial.nNodeId = pfrom->nId;
+        pfrom->PushMessage("getblocktxn", hash, vMissing);
     }
 
 
-    else if (strCommand == "getaddr")
+    else if (strCommand == "getblocktxn")
     {
-        // Nodes rebroadcast an addr every 24 hours
-        pfrom->vAddrToSend.clear();
-        int64 nSince = GetAdjustedTime() - 3 * 60 * 60; // in the last 3 hours
-        CRITICAL_BLOCK(cs_mapAddresses)
+        uint256 hash;
+        vector<unsigned int> vIndexes;
+        vRecv >> hash >> vIndexes;
+
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        CBlock block;
+        if (mi == mapBlockIndex.end() || !ReadCachedBlock((*mi).second, block))
+            return true;
+
+        vector<CTransaction> vtx;
+        BOOST_FOREACH(unsigned int nIndex, vIndexes)
         {
-            unsigned int nCount = 0;
-            BOOST_FOREACH(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                const CAddress& addr = item.second;
-                if (addr.nTime > nSince)
-                    nCount++;
-            }
-            BOOST_FOREACH(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                const CAddress& addr = item.second;
-                if (addr.nTime > nSince && GetRand(nCount) < 2500)
-                    pfrom->PushAddress(addr);
-            }
+            if (nIndex >= block.vtx.size())
+                return error("message getblocktxn index %u out of range", nIndex);
+            vtx.push_back(block.vtx[nIndex]);
         }
+        pfrom->PushMessage("blocktxn", hash, vtx);
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        uint256 hash;
+        vector<CTransaction> vtx;
+        vRecv >> hash >> vtx;
+
+        // Only the peer we asked gets to complete or cancel the block
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(hash);
+        if (mi == mapPartialBlocks.end() || (*mi).second.nNodeId != pfrom->nId)
+            return true;
+        CPartialBlock& partial = (*mi).second;
+        if (vtx.size() != partial.vMissing.size())
+        {
+            mapPartialBlocks.erase(mi);
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+            return error("message blocktxn size() = %d, expected %d", vtx.size(), partial.vMissing.size());
+        }
+
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            partial.block.vtx[partial.vMissing[i]] = vtx[i];
+        CBlock block = partial.block;
+        mapPartialBlocks.erase(mi);
+        return ProcessCompactBlock(pfrom, block);
+    }
+
+
+    else if (strCommand == "getaddr")
+    {
+        // Nodes rebroadcast an addr every 24 hours
+        CRITICAL_BLOCK(pfrom->cs_addr)
+            pfrom->vAddrToSend.clear();
+        vector<CAddress> vAddr = addrman.GetAddr();
+        BOOST_FOREACH(const CAddress& addr, vAddr)
+            pfrom->PushAddress(addr);
     }
 
 
@@ -2897,7 +3833,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             return true;
 
         // Keep-alive ping
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty())
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->nSendSize == 0)
             pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -2912,8 +3848,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
-                    pnode->setAddrKnown.clear();
+                    // Periodically clear filterAddrKnown to allow refresh broadcasts
+                    CRITICAL_BLOCK(pnode->cs_addr)
+                        pnode->filterAddrKnown.clear();
 
                     // Rebroadcast our address
                     if (addrLocalHost.IsRoutable() && !fUseProxy)
@@ -2926,59 +3863,33 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
-        // Clear out old addresses periodically so it's not too much work at once
-        static int64 nLastClear;
-        if (nLastClear == 0)
-            nLastClear = GetTime();
-        if (GetTime() - nLastClear > 10 * 60 && vNodes.size() >= 3)
-        {
-            nLastClear = GetTime();
-            CRITICAL_BLOCK(cs_mapAddresses)
-            {
-                CAddrDB addrdb;
-                int64 nSince = GetAdjustedTime() - 14 * 24 * 60 * 60;
-                for (map<vector<unsigned char>, CAddress>::iterator mi = mapAddresses.begin();
-                     mi != mapAddresses.end();)
-                {
-                    const CAddress& addr = (*mi).second;
-                    if (addr.nTime < nSince)
-                    {
-                        if (mapAddresses.size() < 1000 || GetTime() > nLastClear + 20)
-                            break;
-                        addrdb.EraseAddress(addr);
-                        mapAddresses.erase(mi++);
-                    }
-                    else
-                        mi++;
-                }
-            }
-        }
-
-
         //
         // Message: addr
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            CRITICAL_BLOCK(pto->cs_addr)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                vector<CAddress> vAddr;
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->IsAddressKnown(addr))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->AddAddressKnown(addr);
+                        vAddr.push_back(addr);
+                        // receiver rejects addr messages larger than 1000
+                        if (vAddr.size() >= 1000)
+                        {
+                            pto->PushMessage("addr", vAddr);
+                            vAddr.clear();
+                        }
                     }
                 }
+                pto->vAddrToSend.clear();
+                if (!vAddr.empty())
+                    pto->PushMessage("addr", vAddr);
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
         }
 
 
@@ -2993,7 +3904,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -3012,7 +3923,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     {
                         TRY_CRITICAL_BLOCK(cs_mapWallet)
                         {
-                            map<uint256, CWalletTx>::iterator mi = mapWallet.find(inv.hash);
+                            WalletMap::iterator mi = mapWallet.find(inv.hash);
                             if (mi != mapWallet.end())
                             {
                                 CWalletTx& wtx = (*mi).second;
@@ -3029,15 +3940,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -3058,7 +3966,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (!AlreadyHave(txdb, inv))
             {
                 printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
+                // Near the tip, peers that can send compact blocks save us
+                // downloading transactions we already have
+                if (inv.type == MSG_BLOCK && pto->fCompactBlocks && !GetBoolArg("-nocompactblocks") && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -3254,7 +4167,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         list<COrphan> vOrphan; // list memory doesn't move
         map<uint256, vector<COrphan*> > mapDependers;
         multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        for (TxMap::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
         {
             CTransaction& tx = (*mi).second;
             if (tx.IsCoinBase() || !tx.IsFinal())
@@ -3264,10 +4177,9 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
             double dPriority = 0;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
+                // Read prev transaction's unspent outputs
+                CCoins coins;
+                if (!txdb.ReadCoins(txin.prevout.hash, coins) || !coins.IsAvailable(txin.prevout.n))
                 {
                     // Has to wait for dependencies
                     if (!porphan)
@@ -3280,10 +4192,8 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
                     porphan->setDependsOn.insert(txin.prevout.hash);
                     continue;
                 }
-                int64 nValueIn = txPrev.vout[txin.prevout.n].nValue;
-
-                // Read block header
-                int nConf = txindex.GetDepthInMainChain();
+                int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+                int nConf = 1 + nBestHeight - coins.nHeight;
 
                 dPriority += (double)nValueIn * nConf;
 
@@ -3309,7 +4219,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
         }
 
         // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
+        map<uint256, CCoins> mapTestPool;
         uint64 nBlockSize = 1000;
         int nBlockSigOps = 100;
         while (!mapPriority.empty())
@@ -3333,7 +4243,7 @@ CBlock* CreateNewBlock(CReserveKey& reservekey)
 
             // Connecting shouldn't fail due to dependency on other memory pool transactions
             // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+            map<uint256, CCoins> mapTestPoolTmp(mapTestPool);
             if (!tx.ConnectInputs(txdb, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, nFees, false, true, nMinFee))
                 continue;
             swap(mapTestPool, mapTestPoolTmp);
@@ -3643,7 +4553,7 @@ int64 GetBalance()
     int64 nTotal = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             CWalletTx* pcoin = &(*it).second;
             if (!pcoin->IsFinal() || !pcoin->IsConfirmed())
@@ -3673,7 +4583,7 @@ bool SelectCoinsMinConf(int64 nTargetValue, int nConfMine, int nConfTheirs, set<
     {
        vector<CWalletTx*> vCoins;
        vCoins.reserve(mapWallet.size());
-       for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+       for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
            vCoins.push_back(&(*it).second);
        random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
 
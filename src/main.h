@@ -23,10 +23,15 @@ class CBlock;
 class CBlockIndex;
 class CWalletTx;
 class CKeyItem;
+class CScriptCheck;
+class CCoins;
+class CTxUndo;
 
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
 static const unsigned int MAX_BLOCK_SIZE_GEN = MAX_BLOCK_SIZE/2;
 static const int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
 static const int64 COIN = 100000000;
 static const int64 CENT = 1000000;
 static const int64 MIN_TX_FEE = CENT;
@@ -41,19 +46,23 @@ static const int fHaveUPnP = false;
 #endif
 
 
+typedef boost::unordered_map<uint256, CBlockIndex*, CSaltedHasher> BlockMap;
+typedef boost::unordered_map<uint256, CTransaction, CSaltedHasher> TxMap;
+typedef boost::unordered_map<uint256, CWalletTx, CSaltedHasher> WalletMap;
 
 
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBigNum bnProofOfWorkLimit;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainWork;
-extern CBigNum bnBestInvalidWork;
+extern uint256 nBestChainWork;
+extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
+extern uint256 hashAssumeValid;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
 extern std::map<uint256, int> mapRequestCount;
@@ -83,13 +92,26 @@ extern int fUseUPnP;
 bool CheckDiskSpace(uint64 nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+FILE* OpenUndoFile(unsigned int nFile, unsigned int nUndoPos, const char* pszMode="rb");
+int ReadBlockFile(unsigned int nFile, unsigned int nPos, char* pch, unsigned int nSize);
+bool ReadBlockSize(unsigned int nFile, unsigned int nBlockPos, unsigned int& nSizeRet);
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet);
+CDataStream& GetReadBuffer();
+bool ReadTxFromDisk(const CDiskTxPos& pos, CTransaction& tx);
+void GetRawBlockCacheStats(int64& nHits, int64& nMisses, int& nBlocks, int64& nBytes);
 bool AddKey(const CKey& key);
 std::vector<unsigned char> GenerateNewKey();
 bool AddToWallet(const CWalletTx& wtxIn);
 void WalletUpdateSpent(const COutPoint& prevout);
+int GetTxHeight(const CTxIndex& txindex);
 int ScanForWalletTransactions(CBlockIndex* pindexStart);
 void ReacceptWalletTransactions();
+void* AllocBlockIndex();
+bool CheckCheckpoint(int nHeight, const uint256& hash);
 bool LoadBlockIndex(bool fAllowNew=true);
+void StartScriptCheckThreads();
+void WakeScriptCheckThreads();
+bool RunScriptChecks(std::vector<CScriptCheck>& vChecks);
 void PrintBlockTree();
 bool ProcessMessages(CNode* pfrom);
 bool ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv);
@@ -228,6 +250,11 @@ public:
     }
 };
 
+inline size_t CSaltedHasher::operator()(const COutPoint& outpoint) const
+{
+    return (size_t)outpoint.hash.GetHash(nKey0, nKey1, outpoint.n);
+}
+
 
 
 
@@ -346,7 +373,7 @@ public:
         scriptPubKey.clear();
     }
 
-    bool IsNull()
+    bool IsNull() const
     {
         return (nValue == -1);
     }
@@ -648,6 +675,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+            return ReadTxFromDisk(pos, *this);
+
         CAutoFile filein = OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb");
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -706,9 +736,10 @@ public:
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet);
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout);
     bool ReadFromDisk(COutPoint prevout);
-    bool DisconnectInputs(CTxDB& txdb);
-    bool ConnectInputs(CTxDB& txdb, std::map<uint256, CTxIndex>& mapTestPool, CDiskTxPos posThisTx,
-                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+    bool DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo=NULL);
+    bool ConnectInputs(CTxDB& txdb, std::map<uint256, CCoins>& mapTestPool, CDiskTxPos posThisTx,
+                       CBlockIndex* pindexBlock, int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0,
+                       std::vector<CScriptCheck>* pvChecks=NULL, CTxUndo* ptxundo=NULL, bool* pfMissingInputs=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -726,6 +757,39 @@ public:
 
 
 
+//
+// A deferred signature check of one transaction input, so the script
+// evaluations of a block can be spread across the script check threads
+//
+class CScriptCheck
+{
+public:
+    CScript scriptPubKey;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+
+    CScriptCheck()
+    {
+        ptxTo = NULL;
+        nIn = 0;
+    }
+
+    CScriptCheck(const CTxOut& txoutPrev, const CTransaction& txToIn, unsigned int nInIn)
+    {
+        scriptPubKey = txoutPrev.scriptPubKey;
+        ptxTo = &txToIn;
+        nIn = nInIn;
+    }
+
+    bool operator()() const
+    {
+        return VerifyScript(ptxTo->vin[nIn].scriptSig, scriptPubKey, *ptxTo, nIn, 0);
+    }
+};
+
+
+
+
 
 //
 // A transaction with a merkle branch linking it to the block chain
@@ -1082,25 +1146,24 @@ public:
 
 
 //
-// A txdb record that contains the disk location of a transaction and the
-// locations of transactions that spend its outputs.  vSpent is really only
-// used as a flag, but having the location is very helpful for debugging.
+// A txdb record that contains the disk location of a transaction.
+// Which of its outputs are still unspent is kept in its CCoins record.
 //
 class CTxIndex
 {
 public:
     CDiskTxPos pos;
-    std::vector<CDiskTxPos> vSpent;
+    int nHeight;
 
     CTxIndex()
     {
         SetNull();
     }
 
-    CTxIndex(const CDiskTxPos& posIn, unsigned int nOutputs)
+    CTxIndex(const CDiskTxPos& posIn, int nHeightIn)
     {
         pos = posIn;
-        vSpent.resize(nOutputs);
+        nHeight = nHeightIn;
     }
 
     IMPLEMENT_SERIALIZE
@@ -1108,13 +1171,18 @@ public:
         if (!(nType & SER_GETHASH))
             READWRITE(nVersion);
         READWRITE(pos);
-        READWRITE(vSpent);
+
+        // Height of the containing block, -1 if written before it was kept
+        if (nVersion >= 32201)
+            READWRITE(nHeight);
+        else if (fRead)
+            const_cast<CTxIndex*>(this)->nHeight = -1;
     )
 
     void SetNull()
     {
         pos.SetNull();
-        vSpent.clear();
+        nHeight = -1;
     }
 
     bool IsNull()
@@ -1124,8 +1192,7 @@ public:
 
     friend bool operator==(const CTxIndex& a, const CTxIndex& b)
     {
-        return (a.pos    == b.pos &&
-                a.vSpent == b.vSpent);
+        return (a.pos == b.pos);
     }
 
     friend bool operator!=(const CTxIndex& a, const CTxIndex& b)
@@ -1138,6 +1205,188 @@ public:
 
 
 
+//
+// A txdb record holding the outputs of a transaction that are still
+// unspent, so inputs can be checked without going to the block files.
+// Spent outputs are nulled, and the record is erased once all are spent.
+//
+class CCoins
+{
+public:
+    bool fCoinBase;
+    int nHeight;
+    std::vector<CTxOut> vout;
+
+    CCoins()
+    {
+        SetNull();
+    }
+
+    CCoins(const CTransaction& tx, int nHeightIn)
+    {
+        fCoinBase = tx.IsCoinBase();
+        nHeight = nHeightIn;
+        vout = tx.vout;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(fCoinBase);
+        READWRITE(nHeight);
+        READWRITE(vout);
+    )
+
+    void SetNull()
+    {
+        fCoinBase = false;
+        nHeight = -1;
+        vout.clear();
+    }
+
+    bool IsAvailable(unsigned int n) const
+    {
+        return (n < vout.size() && !vout[n].IsNull());
+    }
+
+    bool IsPruned() const
+    {
+        BOOST_FOREACH(const CTxOut& txout, vout)
+            if (!txout.IsNull())
+                return false;
+        return true;
+    }
+};
+
+
+
+
+
+//
+// What ConnectInputs needs to give back to undo spending an output
+//
+class CTxInUndo
+{
+public:
+    CTxOut txout;
+    bool fCoinBase;
+    int nHeight;
+
+    CTxInUndo()
+    {
+        fCoinBase = false;
+        nHeight = -1;
+    }
+
+    CTxInUndo(const CTxOut& txoutIn, bool fCoinBaseIn, int nHeightIn)
+    {
+        txout = txoutIn;
+        fCoinBase = fCoinBaseIn;
+        nHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txout);
+        READWRITE(fCoinBase);
+        READWRITE(nHeight);
+    )
+};
+
+class CTxUndo
+{
+public:
+    // One for each input
+    std::vector<CTxInUndo> vprevout;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vprevout);
+    )
+};
+
+//
+// The outputs spent by a block, kept in undoNNNN.dat files next to the
+// block files so DisconnectBlock doesn't have to look them up again.
+// Each record is followed by a checksum that also covers the block hash.
+//
+class CBlockUndo
+{
+public:
+    // One for each transaction but the coinbase
+    std::vector<CTxUndo> vtxundo;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vtxundo);
+    )
+
+    uint256 GetChecksum(uint256 hashBlock) const
+    {
+        return SerializeHash(std::make_pair(hashBlock, *this));
+    }
+
+    bool WriteToDisk(unsigned int nFile, unsigned int& nUndoPosRet, uint256 hashBlock)
+    {
+        // Open undo file to append
+        CAutoFile fileout = OpenUndoFile(nFile, 0, "ab");
+        if (!fileout)
+            return error("CBlockUndo::WriteToDisk() : OpenUndoFile failed");
+
+        // Write index header
+        unsigned int nSize = fileout.GetSerializeSize(*this);
+        fileout << FLATDATA(pchMessageStart) << nSize;
+
+        // Write undo data and checksum
+        nUndoPosRet = ftell(fileout);
+        if (nUndoPosRet == -1)
+            return error("CBlockUndo::WriteToDisk() : ftell failed");
+        fileout << *this << GetChecksum(hashBlock);
+
+        // Flush stdio buffers and commit to disk before returning
+        fflush(fileout);
+        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        {
+#ifdef __WXMSW__
+            _commit(_fileno(fileout));
+#else
+            fsync(fileno(fileout));
+#endif
+        }
+
+        return true;
+    }
+
+    bool ReadFromDisk(unsigned int nFile, unsigned int nUndoPos, uint256 hashBlock)
+    {
+        vtxundo.clear();
+
+        // Open undo file to read
+        CAutoFile filein = OpenUndoFile(nFile, nUndoPos, "rb");
+        if (!filein)
+            return error("CBlockUndo::ReadFromDisk() : OpenUndoFile failed");
+
+        // Read undo data and checksum
+        uint256 hashChecksum;
+        try {
+            filein >> *this >> hashChecksum;
+        }
+        catch (std::exception &e) {
+            return error("CBlockUndo::ReadFromDisk() : I/O error");
+        }
+
+        // Verify it
+        if (hashChecksum != GetChecksum(hashBlock))
+            return error("CBlockUndo::ReadFromDisk() : checksum mismatch");
+
+        return true;
+    }
+};
+
+
+
+
 
 //
 // Nodes collect new transactions into a block, hash them into a hash tree,
@@ -1312,15 +1561,21 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
-        filein >> *this;
+        CDataStream& ss = GetReadBuffer();
+        if (fReadTransactions)
+        {
+            if (!ReadRawBlockFromDisk(nFile, nBlockPos, ss))
+                return error("CBlock::ReadFromDisk() : ReadRawBlockFromDisk failed");
+        }
+        else
+        {
+            ss.nType |= SER_BLOCKHEADERONLY;
+            ss.resize(::GetSerializeSize(*this, ss.nType));
+            if (ReadBlockFile(nFile, nBlockPos, &ss[0], ss.size()) != ss.size())
+                return error("CBlock::ReadFromDisk() : ReadBlockFile failed");
+        }
+        ss >> *this;
 
         // Check the header
         if (!CheckProofOfWork(GetHash(), nBits))
@@ -1365,6 +1620,80 @@ public:
 
 
 
+//
+// A block sent as its header, the coinbase and a short ID for each of the
+// other transactions.  The receiver fills in the rest from its memory pool
+// and asks for whatever it doesn't have with getblocktxn.
+//
+class CCompactBlock
+{
+public:
+    CBlock header;
+    uint64 nShortIDNonce;
+    CTransaction txCoinbase;
+    std::vector<uint64> vShortID;
+
+
+    CCompactBlock()
+    {
+        nShortIDNonce = 0;
+    }
+
+    CCompactBlock(const CBlock& block)
+    {
+        header.nVersion = block.nVersion;
+        header.hashPrevBlock = block.hashPrevBlock;
+        header.hashMerkleRoot = block.hashMerkleRoot;
+        header.nTime = block.nTime;
+        header.nBits = block.nBits;
+        header.nNonce = block.nNonce;
+        nShortIDNonce = GetRand(UINT64_MAX);
+        if (!block.vtx.empty())
+            txCoinbase = block.vtx[0];
+
+        uint64 k0, k1;
+        GetShortIDKeys(k0, k1);
+        for (int i = 1; i < block.vtx.size(); i++)
+            vShortID.push_back(GetShortID(block.vtx[i].GetHash(), k0, k1));
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(nShortIDNonce);
+        READWRITE(txCoinbase);
+        READWRITE(vShortID);
+    )
+
+    uint256 GetHash() const
+    {
+        return header.GetHash();
+    }
+
+    // The sender picks a fresh nonce for every block it sends, so nobody
+    // can grind transactions that collide ahead of time
+    void GetShortIDKeys(uint64& k0, uint64& k1) const
+    {
+        uint256 hash = Hash(BEGIN(header.nVersion), END(header.nNonce), BEGIN(nShortIDNonce), END(nShortIDNonce));
+        memcpy(&k0, hash.begin(), sizeof(k0));
+        memcpy(&k1, hash.begin() + sizeof(k0), sizeof(k1));
+    }
+
+    static uint64 GetShortID(const uint256& hashTx, uint64 k0, uint64 k1)
+    {
+        return hashTx.GetHash(k0, k1);
+    }
+};
+
+
+
+
+
 
 //
 // The block chain is a tree shaped structure starting with the
@@ -1380,10 +1709,11 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
-    CBigNum bnChainWork;
+    uint256 nChainWork;
 
     // block header
     int nVersion;
@@ -1398,10 +1728,11 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1415,10 +1746,11 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1450,13 +1782,14 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
         CBigNum bnTarget;
         bnTarget.SetCompact(nBits);
         if (bnTarget <= 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        CBigNum bnWork = (CBigNum(1)<<256) / (bnTarget+1);
+        return bnWork.getuint256();
     }
 
     bool IsInMainChain() const
@@ -1464,6 +1797,12 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // pskip points some way back down the chain so ancestors can be found in
+    // O(log n) steps instead of walking pprev
+    void BuildSkip();
+    CBlockIndex* GetAncestor(int nHeightIn);
+    const CBlockIndex* GetAncestor(int nHeightIn) const;
+
     bool CheckIndex() const
     {
         return CheckProofOfWork(GetBlockHash(), nBits);
@@ -1629,11 +1968,16 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
 
+    explicit CBlockLocator(const std::vector<uint256>& vHaveIn)
+    {
+        vHave = vHaveIn;
+    }
+
     IMPLEMENT_SERIALIZE
     (
         if (!(nType & SER_GETHASH))
@@ -1660,8 +2004,7 @@ public:
             vHave.push_back(pindex->GetBlockHash());
 
             // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            pindex = pindex->GetAncestor(pindex->nHeight - nStep);
             if (vHave.size() > 10)
                 nStep *= 2;
         }
@@ -1675,7 +2018,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1694,7 +2037,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1710,7 +2053,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -2054,8 +2397,8 @@ public:
 
 
 
-extern std::map<uint256, CTransaction> mapTransactions;
-extern std::map<uint256, CWalletTx> mapWallet;
+extern TxMap mapTransactions;
+extern WalletMap mapWallet;
 extern std::vector<uint256> vWalletUpdated;
 extern CCriticalSection cs_mapWallet;
 extern std::map<std::vector<unsigned char>, CPrivKey> mapKeys;
@@ -41,13 +41,13 @@ array<int, 10> vnThreadsRunning;
 SOCKET hListenSocket = INVALID_SOCKET;
 
 vector<CNode*> vNodes;
+int64 nLastNodeId = 0;
 CCriticalSection cs_vNodes;
-map<vector<unsigned char>, CAddress> mapAddresses;
-CCriticalSection cs_mapAddresses;
-map<CInv, CDataStream> mapRelay;
+CAddrMan addrman;
+boost::unordered_map<CInv, CDataStream, CSaltedHasher> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
-map<CInv, int64> mapAlreadyAskedFor;
+boost::unordered_map<CInv, int64, CSaltedHasher> mapAlreadyAskedFor;
 
 // Settings
 int fUseProxy = false;
@@ -92,12 +92,63 @@ bool ConnectSocket(const CAddress& addrConnect, SOCKET& hSocketRet)
     bool fProxy = (fUseProxy && fRoutable);
     struct sockaddr_in sockaddr = (fProxy ? addrProxy.GetSockAddr() : addrConnect.GetSockAddr());
 
-    if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+    // Connect without blocking, so a dead address costs at most -timeout
+    // milliseconds instead of the system's connect timeout
+#ifdef __WXMSW__
+    u_long fNonblock = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
+#else
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
+    if (hSocket >= FD_SETSIZE || fcntl(hSocket, F_SETFL, fFlags | O_NONBLOCK) == SOCKET_ERROR)
+#endif
     {
         closesocket(hSocket);
         return false;
     }
 
+    if (connect(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINPROGRESS && nErr != WSAEWOULDBLOCK)
+        {
+            closesocket(hSocket);
+            return false;
+        }
+
+        int64 nTimeout = GetArg("-timeout", 5000);
+        struct timeval timeout;
+        timeout.tv_sec  = nTimeout / 1000;
+        timeout.tv_usec = (nTimeout % 1000) * 1000;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetSend);
+        FD_SET(hSocket, &fdsetSend);
+        int nRet = select(hSocket + 1, NULL, &fdsetSend, NULL, &timeout);
+        if (nRet <= 0)
+        {
+            if (nRet == 0)
+                printf("connection timeout %s\n", addrConnect.ToString().c_str());
+            closesocket(hSocket);
+            return false;
+        }
+
+        // The socket is writable once the connect has finished either way
+        socklen_t nRetSize = sizeof(nRet);
+        if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)&nRet, &nRetSize) == SOCKET_ERROR || nRet != 0)
+        {
+            closesocket(hSocket);
+            return false;
+        }
+    }
+
+    // Back to blocking for the proxy handshake, ConnectNode sets it
+    // nonblocking again
+#ifdef __WXMSW__
+    fNonblock = 0;
+    ioctlsocket(hSocket, FIONBIO, &fNonblock);
+#else
+    fcntl(hSocket, F_SETFL, fFlags);
+#endif
+
     if (fProxy)
     {
         printf("proxy connecting %s\n", addrConnect.ToString().c_str());
@@ -333,7 +384,7 @@ void ThreadGetMyExternalIP(void* parg)
         if (addrLocalHost.IsRoutable())
         {
             // If we already connected to a few before we had our IP, go back and addr them.
-            // setAddrKnown automatically filters any duplicate sends.
+            // filterAddrKnown automatically filters any duplicate sends.
             CAddress addr(addrLocalHost);
             addr.nTime = GetAdjustedTime();
             CRITICAL_BLOCK(cs_vNodes)
@@ -347,68 +398,396 @@ void ThreadGetMyExternalIP(void* parg)
 
 
 
-bool AddAddress(CAddress addr, int64 nTimePenalty)
+//
+// CAddrMan
+//
+
+static const int ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP = 32;
+static const int ADDRMAN_TRIED_BUCKETS_PER_GROUP = 8;
+static const int ADDRMAN_GETADDR_MAX_PCT = 23;
+static const int ADDRMAN_GETADDR_MAX = 2500;
+
+static inline uint64 GetAddrManKey(const CAddress& addr)
 {
-    if (!addr.IsRoutable())
-        return false;
-    if (addr.ip == addrLocalHost.ip)
+    return (uint64)addr.ip | ((uint64)addr.port << 32);
+}
+
+bool CAddrInfo::IsTerrible(int64 nNow) const
+{
+    // Never drop something we just tried
+    if (nLastTry && nLastTry >= nNow - 60)
         return false;
-    addr.nTime = max((int64)0, (int64)addr.nTime - nTimePenalty);
-    CRITICAL_BLOCK(cs_mapAddresses)
+
+    // Timestamp from the future
+    if (nTime > nNow + 10 * 60)
+        return true;
+
+    // Not seen in a month
+    if (nTime == 0 || nNow - nTime > 30 * 24 * 60 * 60)
+        return true;
+
+    // Tried a few times and never succeeded
+    if (nLastSuccess == 0 && nAttempts >= 3)
+        return true;
+
+    // Failing for a week
+    if (nNow - nLastSuccess > 7 * 24 * 60 * 60 && nAttempts >= 10)
+        return true;
+
+    return false;
+}
+
+double CAddrInfo::GetChance(int64 nNow) const
+{
+    double fChance = 1.0;
+
+    // Back off from addresses we tried in the last ten minutes
+    int64 nSinceLastTry = max(nNow - (int64)nLastTry, (int64)0);
+    if (nSinceLastTry < 10 * 60)
+        fChance *= 0.01;
+
+    // Halve the chance for roughly every two failed attempts
+    fChance *= pow(0.66, min(nAttempts, 8));
+
+    return fChance;
+}
+
+CAddrMan::CAddrMan()
+{
+    Clear();
+    RAND_bytes((unsigned char*)&nKey, sizeof(nKey));
+}
+
+void CAddrMan::Clear()
+{
+    mapInfo.clear();
+    mapAddr.clear();
+    vRandomNew.clear();
+    vRandomTried.clear();
+    nIdCount = 0;
+    for (int i = 0; i < ADDRMAN_NEW_BUCKETS; i++)
+        for (int j = 0; j < ADDRMAN_BUCKET_SIZE; j++)
+            vvNew[i][j] = -1;
+    for (int i = 0; i < ADDRMAN_TRIED_BUCKETS; i++)
+        for (int j = 0; j < ADDRMAN_BUCKET_SIZE; j++)
+            vvTried[i][j] = -1;
+}
+
+uint64 CAddrMan::GetKeyedHash(uint64 n1, uint64 n2, uint64 n3) const
+{
+    uint64 pn[3] = { n1, n2, n3 };
+    uint256 hash = Hash(BEGIN(nKey), END(nKey), BEGIN(pn), END(pn));
+    uint64 nRet;
+    memcpy(&nRet, hash.begin(), sizeof(nRet));
+    return nRet;
+}
+
+int CAddrMan::GetNewBucket(const CAddrInfo& info) const
+{
+    // One source group can only reach a handful of the new buckets
+    uint64 nGroup = info.ip & 0x0000ffff;
+    uint64 nSourceGroup = info.nSourceIP & 0x0000ffff;
+    uint64 nSlot = GetKeyedHash(1, nGroup, nSourceGroup) % ADDRMAN_NEW_BUCKETS_PER_SOURCE_GROUP;
+    return GetKeyedHash(2, nSourceGroup, nSlot) % ADDRMAN_NEW_BUCKETS;
+}
+
+int CAddrMan::GetTriedBucket(const CAddrInfo& info) const
+{
+    // One group can only reach a handful of the tried buckets
+    uint64 nGroup = info.ip & 0x0000ffff;
+    uint64 nSlot = GetKeyedHash(3, GetAddrManKey(info), 0) % ADDRMAN_TRIED_BUCKETS_PER_GROUP;
+    return GetKeyedHash(4, nGroup, nSlot) % ADDRMAN_TRIED_BUCKETS;
+}
+
+int CAddrMan::GetBucketPos(bool fNew, int nBucket, const CAddrInfo& info) const
+{
+    return GetKeyedHash(fNew ? 5 : 6, nBucket, GetAddrManKey(info)) % ADDRMAN_BUCKET_SIZE;
+}
+
+// Each table keeps its entries in a vector too, so Select can pick one of
+// them at random in constant time
+void CAddrMan::AddRandom(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    vector<int>& vRandom = (info.fInTried ? vRandomTried : vRandomNew);
+    info.nRandomPos = vRandom.size();
+    vRandom.push_back(nId);
+}
+
+void CAddrMan::RemoveRandom(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+    vector<int>& vRandom = (info.fInTried ? vRandomTried : vRandomNew);
+
+    // Move the last random slot into the hole
+    int nLast = vRandom.back();
+    vRandom[info.nRandomPos] = nLast;
+    mapInfo[nLast].nRandomPos = info.nRandomPos;
+    vRandom.pop_back();
+    info.nRandomPos = -1;
+}
+
+CAddrInfo* CAddrMan::Find(const CAddress& addr, int* pnId)
+{
+    map<uint64, int>::iterator it = mapAddr.find(GetAddrManKey(addr));
+    if (it == mapAddr.end())
+        return NULL;
+    if (pnId)
+        *pnId = (*it).second;
+    return &mapInfo[(*it).second];
+}
+
+int CAddrMan::Create(const CAddrInfo& info)
+{
+    int nId = nIdCount++;
+    CAddrInfo& infoNew = mapInfo[nId];
+    infoNew = info;
+    infoNew.fInTried = false;
+    mapAddr[GetAddrManKey(info)] = nId;
+    AddRandom(nId);
+    return nId;
+}
+
+// The caller has already taken the entry out of its bucket
+void CAddrMan::Delete(int nId)
+{
+    RemoveRandom(nId);
+    mapAddr.erase(GetAddrManKey(mapInfo[nId]));
+    mapInfo.erase(nId);
+}
+
+bool CAddrMan::PlaceNew(int nId)
+{
+    const CAddrInfo& info = mapInfo[nId];
+    int nBucket = GetNewBucket(info);
+    int nPos = GetBucketPos(true, nBucket, info);
+    int nIdOld = vvNew[nBucket][nPos];
+    if (nIdOld != -1)
     {
-        map<vector<unsigned char>, CAddress>::iterator it = mapAddresses.find(addr.GetKey());
-        if (it == mapAddresses.end())
+        // Only push out an entry that isn't worth keeping
+        if (!mapInfo[nIdOld].IsTerrible(GetAdjustedTime()))
         {
-            // New address
-            printf("AddAddress(%s)\n", addr.ToString().c_str());
-            mapAddresses.insert(make_pair(addr.GetKey(), addr));
-            CAddrDB().WriteAddress(addr);
-            return true;
+            Delete(nId);
+            return false;
         }
+        Delete(nIdOld);
+    }
+    vvNew[nBucket][nPos] = nId;
+    return true;
+}
+
+void CAddrMan::MakeTried(int nId)
+{
+    CAddrInfo& info = mapInfo[nId];
+
+    // Take it out of its new bucket
+    int nBucket = GetNewBucket(info);
+    int nPos = GetBucketPos(true, nBucket, info);
+    if (vvNew[nBucket][nPos] == nId)
+        vvNew[nBucket][nPos] = -1;
+
+    int nTriedBucket = GetTriedBucket(info);
+    int nTriedPos = GetBucketPos(false, nTriedBucket, info);
+    int nIdOld = vvTried[nTriedBucket][nTriedPos];
+    if (nIdOld != -1)
+    {
+        // The entry we displace goes back to new if its slot there is free
+        CAddrInfo& infoOld = mapInfo[nIdOld];
+        vvTried[nTriedBucket][nTriedPos] = -1;
+        RemoveRandom(nIdOld);
+        infoOld.fInTried = false;
+        AddRandom(nIdOld);
+        int nOldBucket = GetNewBucket(infoOld);
+        int nOldPos = GetBucketPos(true, nOldBucket, infoOld);
+        if (vvNew[nOldBucket][nOldPos] == -1)
+            vvNew[nOldBucket][nOldPos] = nIdOld;
         else
+            Delete(nIdOld);
+    }
+
+    vvTried[nTriedBucket][nTriedPos] = nId;
+    RemoveRandom(nId);
+    info.fInTried = true;
+    AddRandom(nId);
+}
+
+void CAddrMan::Load(const uint256& nKeyIn, const vector<CAddrInfo>& vInfo)
+{
+    Clear();
+    nKey = nKeyIn;
+    BOOST_FOREACH(const CAddrInfo& info, vInfo)
+    {
+        if (!info.IsIPv4() || !info.IsValid() || Find(info))
+            continue;
+        int nId = Create(info);
+        if (info.fInTried)
         {
-            bool fUpdated = false;
-            CAddress& addrFound = (*it).second;
-            if ((addrFound.nServices | addr.nServices) != addrFound.nServices)
+            int nBucket = GetTriedBucket(info);
+            int nPos = GetBucketPos(false, nBucket, info);
+            if (vvTried[nBucket][nPos] == -1)
             {
-                // Services have been added
-                addrFound.nServices |= addr.nServices;
-                fUpdated = true;
+                vvTried[nBucket][nPos] = nId;
+                RemoveRandom(nId);
+                mapInfo[nId].fInTried = true;
+                AddRandom(nId);
+                continue;
             }
-            bool fCurrentlyOnline = (GetAdjustedTime() - addr.nTime < 24 * 60 * 60);
+        }
+        PlaceNew(nId);
+    }
+}
+
+bool CAddrMan::Add(const CAddress& addr, const CAddress& addrSource, int64 nTimePenalty)
+{
+    int64 nNow = GetAdjustedTime();
+    unsigned int nTime = max((int64)0, (int64)addr.nTime - nTimePenalty);
+    CRITICAL_BLOCK(cs)
+    {
+        CAddrInfo* pinfo = Find(addr);
+        if (pinfo)
+        {
+            // Services have been added
+            pinfo->nServices |= addr.nServices;
+
+            // Periodically update most recently seen time
+            bool fCurrentlyOnline = (nNow - nTime < 24 * 60 * 60);
             int64 nUpdateInterval = (fCurrentlyOnline ? 60 * 60 : 24 * 60 * 60);
-            if (addrFound.nTime < addr.nTime - nUpdateInterval)
-            {
-                // Periodically update most recently seen time
-                addrFound.nTime = addr.nTime;
-                fUpdated = true;
-            }
-            if (fUpdated)
-                CAddrDB().WriteAddress(addrFound);
+            if (pinfo->nTime < nTime - nUpdateInterval)
+                pinfo->nTime = nTime;
+            return false;
         }
+
+        // Addresses that announce themselves count as their own source
+        CAddrInfo info(addr, addrSource.IsValid() ? addrSource.ip : addr.ip);
+        info.nTime = nTime;
+        info.nLastTry = 0;
+        if (!PlaceNew(Create(info)))
+            return false;
     }
-    return false;
+    return true;
 }
 
-void AddressCurrentlyConnected(const CAddress& addr)
+void CAddrMan::Good(const CAddress& addr)
+{
+    int64 nNow = GetAdjustedTime();
+    CRITICAL_BLOCK(cs)
+    {
+        int nId;
+        CAddrInfo* pinfo = Find(addr, &nId);
+        if (!pinfo)
+            return;
+        pinfo->nLastSuccess = nNow;
+        pinfo->nLastTry = nNow;
+        pinfo->nTime = nNow;
+        pinfo->nAttempts = 0;
+        if (!pinfo->fInTried)
+            MakeTried(nId);
+    }
+}
+
+void CAddrMan::Attempt(const CAddress& addr)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        CAddrInfo* pinfo = Find(addr);
+        if (!pinfo)
+            return;
+        pinfo->nLastTry = GetAdjustedTime();
+        pinfo->nAttempts++;
+    }
+}
+
+void CAddrMan::Connected(const CAddress& addr)
+{
+    int64 nNow = GetAdjustedTime();
+    CRITICAL_BLOCK(cs)
+    {
+        // Periodically update most recently seen time
+        CAddrInfo* pinfo = Find(addr);
+        if (pinfo && pinfo->nTime < nNow - 20 * 60)
+            pinfo->nTime = nNow;
+    }
+}
+
+CAddress CAddrMan::Select()
 {
-    CRITICAL_BLOCK(cs_mapAddresses)
+    int64 nNow = GetAdjustedTime();
+    CRITICAL_BLOCK(cs)
     {
-        // Only if it's been published already
-        map<vector<unsigned char>, CAddress>::iterator it = mapAddresses.find(addr.GetKey());
-        if (it != mapAddresses.end())
+        if (vRandomNew.empty() && vRandomTried.empty())
+            return CAddress();
+
+        // Even odds between the tried and new tables, then sample entries
+        // of that table, accepting each by its chance and getting less
+        // picky after every miss
+        bool fTried = (!vRandomTried.empty() && (vRandomNew.empty() || GetRandInt(2) == 0));
+        const vector<int>& vRandom = (fTried ? vRandomTried : vRandomNew);
+        double fChanceFactor = 1.0;
+        loop
         {
-            CAddress& addrFound = (*it).second;
-            int64 nUpdateInterval = 20 * 60;
-            if (addrFound.nTime < GetAdjustedTime() - nUpdateInterval)
-            {
-                // Periodically update most recently seen time
-                addrFound.nTime = GetAdjustedTime();
-                CAddrDB addrdb;
-                addrdb.WriteAddress(addrFound);
-            }
+            const CAddrInfo& info = mapInfo[vRandom[GetRandInt(vRandom.size())]];
+            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance(nNow) * (1 << 30))
+                return info;
+            fChanceFactor *= 1.2;
+        }
+    }
+    return CAddress();
+}
+
+vector<CAddress> CAddrMan::GetAddr()
+{
+    int64 nNow = GetAdjustedTime();
+    vector<CAddress> vAddr;
+    CRITICAL_BLOCK(cs)
+    {
+        vector<int> vId(vRandomNew);
+        vId.insert(vId.end(), vRandomTried.begin(), vRandomTried.end());
+        int nNodes = min(ADDRMAN_GETADDR_MAX, (int)(ADDRMAN_GETADDR_MAX_PCT * vId.size() / 100));
+
+        // Partial shuffle of both tables' entries
+        for (int n = 0; n < vId.size() && vAddr.size() < nNodes; n++)
+        {
+            int nSwap = n + GetRandInt(vId.size() - n);
+            swap(vId[n], vId[nSwap]);
+            const CAddrInfo& info = mapInfo[vId[n]];
+            if (!info.IsTerrible(nNow))
+                vAddr.push_back(info);
         }
     }
+    return vAddr;
+}
+
+int CAddrMan::size()
+{
+    CRITICAL_BLOCK(cs)
+        return vRandomNew.size() + vRandomTried.size();
+    return 0;
+}
+
+
+
+
+
+bool AddAddress(CAddress addr, int64 nTimePenalty, const CAddress& addrSource)
+{
+    if (!addr.IsRoutable() || !addr.IsIPv4())
+        return false;
+    if (addr.ip == addrLocalHost.ip)
+        return false;
+    if (!addrman.Add(addr, addrSource, nTimePenalty))
+        return false;
+    printf("AddAddress(%s)\n", addr.ToString().c_str());
+    return true;
+}
+
+bool AddAddress(CAddress addr, int64 nTimePenalty)
+{
+    return AddAddress(addr, nTimePenalty, CAddress());
+}
+
+void AddressCurrentlyConnected(const CAddress& addr)
+{
+    addrman.Connected(addr);
 }
 
 
@@ -560,13 +939,19 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
         (double)(addrConnect.nTime - GetAdjustedTime())/3600.0,
         (double)(addrConnect.nLastTry - GetAdjustedTime())/3600.0);
 
-    CRITICAL_BLOCK(cs_mapAddresses)
-        mapAddresses[addrConnect.GetKey()].nLastTry = GetAdjustedTime();
+    addrman.Attempt(addrConnect);
 
     // Connect
     SOCKET hSocket;
     if (ConnectSocket(addrConnect, hSocket))
     {
+        // The connect can take seconds, don't add a node once we're stopping
+        if (fShutdown)
+        {
+            closesocket(hSocket);
+            return NULL;
+        }
+
         /// debug print
         printf("connected %s\n", addrConnect.ToString().c_str());
 
@@ -598,6 +983,83 @@ CNode* ConnectNode(CAddress addrConnect, int64 nTimeout)
     }
 }
 
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min((unsigned int)hdrbuf.size() - nHdrPos, nBytes);
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+    if (nHdrPos < hdrbuf.size())
+        return nCopy;
+
+    try
+    {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception& e)
+    {
+        return -1;
+    }
+    if (!hdr.IsValid())
+    {
+        printf("CNetMessage::ReadHeader() : errors in header %s\n", hdr.GetCommand().c_str());
+        return -1;
+    }
+
+    // Only as much as one socket read brings in, ReadData grows the buffer
+    // from there as the payload arrives
+    vRecv.reserve(min(hdr.nMessageSize, 0x10000u));
+    fInData = true;
+    return nCopy;
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nCopy = min(hdr.nMessageSize - nDataPos, nBytes);
+    vRecv.resize(nDataPos + nCopy);
+    memcpy(&vRecv[nDataPos], pch, nCopy);
+    nDataPos += nCopy;
+    return nCopy;
+}
+
+unsigned int CNetMessage::GetChecksum() const
+{
+    uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nDataPos);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum;
+}
+
+// Frame received bytes into messages, returns false if the peer sent
+// something that can't be a message header.  fCompleteRet is set if at
+// least one message was finished.
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fCompleteRet)
+{
+    fCompleteRet = false;
+    while (nBytes > 0)
+    {
+        if (vRecvMsg.empty() || vRecvMsg.back().IsComplete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+        CNetMessage& msg = vRecvMsg.back();
+
+        int nUsed = msg.fInData ? msg.ReadData(pch, nBytes) : msg.ReadHeader(pch, nBytes);
+        if (nUsed < 0)
+            return false;
+        pch += nUsed;
+        nBytes -= nUsed;
+        if (msg.IsComplete())
+            fCompleteRet = true;
+    }
+    return true;
+}
+
+unsigned int CNode::GetTotalRecvSize() const
+{
+    unsigned int nTotal = 0;
+    BOOST_FOREACH(const CNetMessage& msg, vRecvMsg)
+        nTotal += msg.GetAllocatedSize();
+    return nTotal;
+}
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
@@ -653,11 +1115,218 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exiting\n");
 }
 
+// Readiness from select() only lasts for one pass, so this rebuilds the fd
+// sets from every node each time.  Sockets past FD_SETSIZE can't be watched.
+static void WaitForSocketsSelect(bool& fListenReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+
+    if(hListenSocket != INVALID_SOCKET)
+        FD_SET(hListenSocket, &fdsetRecv);
+    hSocketMax = max(hSocketMax, hListenSocket);
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET || pnode->hSocket < 0)
+                continue;
+#ifndef __WXMSW__
+            if (pnode->hSocket >= FD_SETSIZE)
+                continue;
+#endif
+            FD_SET(pnode->hSocket, &fdsetRecv);
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            TRY_CRITICAL_BLOCK(pnode->cs_vSend)
+                if (pnode->nSendSize > 0)
+                    FD_SET(pnode->hSocket, &fdsetSend);
+        }
+    }
+
+    vnThreadsRunning[0]--;
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    vnThreadsRunning[0]++;
+    if (fShutdown)
+        return;
+    if (nSelect == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        printf("socket select error %d\n", nErr);
+        for (int i = 0; i <= hSocketMax; i++)
+            FD_SET(i, &fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        Sleep(timeout.tv_usec/1000);
+    }
+
+    fListenReady = (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv));
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            SOCKET hSocket = pnode->hSocket;
+            bool fValid = (hSocket != INVALID_SOCKET);
+#ifndef __WXMSW__
+            fValid = fValid && hSocket < FD_SETSIZE;
+#endif
+            pnode->fRecvReady = fValid && (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError));
+            pnode->fSendReady = fValid && FD_ISSET(hSocket, &fdsetSend);
+        }
+    }
+}
+
+#ifdef __linux__
+// Edge-triggered epoll only reports a socket when its state changes, so the
+// ready flags stay set until a read or write comes up short.  Each pass
+// costs time in proportion to the sockets that are active, not all of them.
+// Closing a socket takes it out of the epoll set, and nodes are only deleted
+// by this thread, so the node pointers in events are always good.
+static void WaitForSocketsEpoll(int hEpoll, bool& fListenReady)
+{
+    bool fPending = fListenReady;
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fPollRegistered)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == 0)
+                    pnode->fPollRegistered = true;
+                else
+                    printf("epoll_ctl add failed %d\n", errno);
+            }
+            if (pnode->fRecvReady || (pnode->fSendReady && pnode->nSendSize > 0))
+                fPending = true;
+        }
+    }
+
+    // Don't wait if there's work left over from last time
+    struct epoll_event events[256];
+    vnThreadsRunning[0]--;
+    int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), fPending ? 0 : 50);
+    vnThreadsRunning[0]++;
+    if (fShutdown)
+        return;
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+            printf("socket epoll_wait error %d\n", errno);
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++)
+    {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL)
+        {
+            fListenReady = true;
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            pnode->fRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSendReady = true;
+    }
+}
+#endif
+
+// Send queued messages until the socket would block.  A message that has
+// started going out is finished before anything more urgent is sent.
+// Must be called with cs_vSend held.
+static void SocketSendData(CNode* pnode)
+{
+    unsigned int nSendSizeBefore = pnode->nSendSize;
+    while (true)
+    {
+        if (pnode->nSendOffset == pnode->vchSending.size())
+        {
+            pnode->vchSending.clear();
+            pnode->nSendOffset = 0;
+            int nClass = 0;
+            while (nClass < SEND_CLASSES && pnode->vSendQueue[nClass].empty())
+                nClass++;
+            if (nClass == SEND_CLASSES)
+                break;
+            pnode->vchSending.swap(pnode->vSendQueue[nClass].front());
+            pnode->vSendQueue[nClass].pop_front();
+        }
+
+        unsigned int nLeft = pnode->vchSending.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &pnode->vchSending[pnode->nSendOffset], nLeft, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes > 0)
+        {
+            pnode->nSendOffset += nBytes;
+            pnode->nSendSize -= nBytes;
+            pnode->nLastSend = GetTime();
+        }
+        else if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                printf("socket send error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
+        }
+
+        // Socket buffer is full until the next event
+        if (nBytes < (int)nLeft)
+        {
+            pnode->fSendReady = false;
+            break;
+        }
+    }
+
+    // Let the handler queue more for this node
+    unsigned int nLimit = SendBufferSize();
+    if (pnode->nSendSize < nSendSizeBefore && (pnode->nSendSize == 0 || (nSendSizeBefore >= nLimit && pnode->nSendSize < nLimit)))
+        WakeMessageHandler();
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     int nPrevNodeCount = 0;
+    bool fListenReady = false;
+
+    int hEpoll = -1;
+#ifdef __linux__
+    if (!GetBoolArg("-noepoll"))
+    {
+        hEpoll = epoll_create(1024);
+        if (hEpoll == -1)
+            printf("epoll_create failed %d, using select\n", errno);
+    }
+    if (hEpoll != -1 && hListenSocket != INVALID_SOCKET)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) != 0)
+        {
+            printf("epoll_ctl add listen socket failed %d, using select\n", errno);
+            close(hEpoll);
+            hEpoll = -1;
+        }
+    }
+#endif
 
     loop
     {
@@ -671,7 +1340,7 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
                 if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0))
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -719,57 +1388,26 @@ void ThreadSocketHandler2(void* parg)
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-
-        if(hListenSocket != INVALID_SOCKET)
-            FD_SET(hListenSocket, &fdsetRecv);
-        hSocketMax = max(hSocketMax, hListenSocket);
-        CRITICAL_BLOCK(cs_vNodes)
-        {
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET || pnode->hSocket < 0)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                TRY_CRITICAL_BLOCK(pnode->cs_vSend)
-                    if (!pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-            }
-        }
-
-        vnThreadsRunning[0]--;
-        int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        vnThreadsRunning[0]++;
+#ifdef __linux__
+        if (hEpoll != -1)
+            WaitForSocketsEpoll(hEpoll, fListenReady);
+        else
+#endif
+            WaitForSocketsSelect(fListenReady);
         if (fShutdown)
-            return;
-        if (nSelect == SOCKET_ERROR)
         {
-            int nErr = WSAGetLastError();
-            printf("socket select error %d\n", nErr);
-            for (int i = 0; i <= hSocketMax; i++)
-                FD_SET(i, &fdsetRecv);
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            Sleep(timeout.tv_usec/1000);
+#ifdef __linux__
+            if (hEpoll != -1)
+                close(hEpoll);
+#endif
+            return;
         }
 
 
         //
         // Accept new connections
         //
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && fListenReady)
         {
             struct sockaddr_in sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -783,8 +1421,15 @@ void ThreadSocketHandler2(void* parg)
                     nInbound++;
             if (hSocket == INVALID_SOCKET)
             {
-                if (WSAGetLastError() != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", WSAGetLastError());
+                int nErr = WSAGetLastError();
+                // Out of descriptors, the connection is still queued but
+                // there won't be another event for it, so try again on the
+                // next pass.  Otherwise there's nothing more to accept until
+                // the next event.
+                if (nErr != WSAEMFILE && nErr != ENFILE)
+                    fListenReady = false;
+                if (nErr != WSAEWOULDBLOCK)
+                    printf("socket error accept failed: %d\n", nErr);
             }
             else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
             {
@@ -821,26 +1466,35 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fRecvReady)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
                 {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
+                    unsigned int nRecvSize = pnode->GetTotalRecvSize();
 
-                    if (nPos > 1000*GetArg("-maxreceivebuffer", 10*1000)) {
+                    if (nRecvSize > 1000*GetArg("-maxreceivebuffer", 10*1000)) {
                         if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%d bytes)\n", vRecv.size());
+                            printf("socket recv flood control disconnect (%d bytes)\n", nRecvSize);
                         pnode->CloseSocketDisconnect();
                     }
                     else {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // A short read drained the socket, anything newer
+                        // will raise another event
+                        if (nBytes < (int)sizeof(pchBuf))
+                            pnode->fRecvReady = false;
                         if (nBytes > 0)
                         {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
+                            bool fComplete;
+                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+                            {
+                                printf("socket bad message header, disconnecting\n");
+                                pnode->CloseSocketDisconnect();
+                            }
+                            else if (fComplete)
+                                WakeMessageHandler();
                             pnode->nLastRecv = GetTime();
                         }
                         else if (nBytes == 0)
@@ -870,34 +1524,17 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fSendReady)
             {
                 TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                        if (vSend.size() > 1000*GetArg("-maxsendbuffer", 10*1000)) {
-                            if (!pnode->fDisconnect)
-                                printf("socket send flood control disconnect (%d bytes)\n", vSend.size());
-                            pnode->CloseSocketDisconnect();
-                        }
+                    SocketSendData(pnode);
+
+                    // Queues only grow past the limit if the peer isn't reading
+                    if (pnode->nSendSize > 10 * SendBufferSize()) {
+                        if (!pnode->fDisconnect)
+                            printf("socket send flood control disconnect (%u bytes)\n", pnode->nSendSize);
+                        pnode->CloseSocketDisconnect();
                     }
                 }
             }
@@ -905,7 +1542,7 @@ void ThreadSocketHandler2(void* parg)
             //
             // Inactivity checking
             //
-            if (pnode->vSend.empty())
+            if (pnode->nSendSize == 0)
                 pnode->nLastSendEmpty = GetTime();
             if (GetTime() - pnode->nTimeConnected > 60)
             {
@@ -1146,6 +1783,63 @@ void ThreadOpenConnections(void* parg)
     printf("ThreadOpenConnections exiting\n");
 }
 
+//
+// Outbound connection attempts each run in their own thread, so a few
+// dead addresses don't hold up filling the other slots.  Attempts in
+// flight count against the outbound limit.
+//
+static set<unsigned int> setConnecting;
+static CCriticalSection cs_setConnecting;
+
+static int GetConnectingCount()
+{
+    CRITICAL_BLOCK(cs_setConnecting)
+        return setConnecting.size();
+    return 0;
+}
+
+static void ThreadConnectAttempt(void* parg)
+{
+    CAddress addrConnect = *(CAddress*)parg;
+    delete (CAddress*)parg;
+    try
+    {
+        if (!fShutdown && !FindNode(addrConnect.ip))
+        {
+            CNode* pnode = ConnectNode(addrConnect);
+            if (pnode)
+                pnode->fNetworkNode = true;
+        }
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadConnectAttempt()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ThreadConnectAttempt()");
+    }
+    CRITICAL_BLOCK(cs_setConnecting)
+        setConnecting.erase(addrConnect.ip);
+}
+
+static bool StartConnectAttempt(const CAddress& addrConnect)
+{
+    if (addrConnect.ip == addrLocalHost.ip || !addrConnect.IsIPv4())
+        return false;
+    CRITICAL_BLOCK(cs_setConnecting)
+        if (!setConnecting.insert(addrConnect.ip).second)
+            return false;
+
+    CAddress* paddr = new CAddress(addrConnect);
+    if (!CreateThread(ThreadConnectAttempt, paddr))
+    {
+        printf("Error: CreateThread(ThreadConnectAttempt) failed\n");
+        delete paddr;
+        CRITICAL_BLOCK(cs_setConnecting)
+            setConnecting.erase(addrConnect.ip);
+        return false;
+    }
+    return true;
+}
+
 void ThreadOpenConnections2(void* parg)
 {
     printf("ThreadOpenConnections started\n");
@@ -1178,8 +1872,7 @@ void ThreadOpenConnections2(void* parg)
             CAddress addr(strAddr, fAllowDNS);
             if (addr.IsValid())
             {
-                OpenNetworkConnection(addr);
-                Sleep(500);
+                StartConnectAttempt(addr);
                 if (fShutdown)
                     return;
             }
@@ -1200,9 +1893,10 @@ void ThreadOpenConnections2(void* parg)
                 BOOST_FOREACH(CNode* pnode, vNodes)
                     if (!pnode->fInbound)
                         nOutbound++;
+            int nConnecting = GetConnectingCount();
             int nMaxOutboundConnections = MAX_OUTBOUND_CONNECTIONS;
             nMaxOutboundConnections = min(nMaxOutboundConnections, (int)GetArg("-maxconnections", 125));
-            if (nOutbound < nMaxOutboundConnections)
+            if (nOutbound + nConnecting < nMaxOutboundConnections)
                 break;
             Sleep(2000);
             if (fShutdown)
@@ -1212,125 +1906,93 @@ void ThreadOpenConnections2(void* parg)
         if (fShutdown)
             return;
 
-        CRITICAL_BLOCK(cs_mapAddresses)
+        // Add seed nodes if IRC isn't working
+        static bool fSeedUsed;
+        bool fTOR = (fUseProxy && addrProxy.port == htons(9050));
+        if (addrman.size() == 0 && (GetTime() - nStart > 60 || fTOR) && !fTestNet)
         {
-            // Add seed nodes if IRC isn't working
-            static bool fSeedUsed;
-            bool fTOR = (fUseProxy && addrProxy.port == htons(9050));
-            if (mapAddresses.empty() && (GetTime() - nStart > 60 || fTOR) && !fTestNet)
+            for (int i = 0; i < ARRAYLEN(pnSeed); i++)
             {
-                for (int i = 0; i < ARRAYLEN(pnSeed); i++)
-                {
-                    // It'll only connect to one or two seed nodes because once it connects,
-                    // it'll get a pile of addresses with newer timestamps.
-                    CAddress addr;
-                    addr.ip = pnSeed[i];
-                    addr.nTime = 0;
-                    AddAddress(addr);
-                }
-                fSeedUsed = true;
+                // It'll only connect to one or two seed nodes because once it connects,
+                // it'll get a pile of addresses with newer timestamps.
+                CAddress addr;
+                addr.ip = pnSeed[i];
+                addr.nTime = 0;
+                AddAddress(addr);
             }
+            fSeedUsed = true;
+        }
 
-            if (fSeedUsed && mapAddresses.size() > ARRAYLEN(pnSeed) + 100)
+        // Disconnect seed nodes and stay away from them for an hour
+        set<unsigned int> setSeed;
+        if (fSeedUsed && addrman.size() > ARRAYLEN(pnSeed) + 100)
+        {
+            static int64 nSeedDisconnected;
+            if (nSeedDisconnected == 0)
             {
-                // Disconnect seed nodes
-                set<unsigned int> setSeed(pnSeed, pnSeed + ARRAYLEN(pnSeed));
-                static int64 nSeedDisconnected;
-                if (nSeedDisconnected == 0)
-                {
-                    nSeedDisconnected = GetTime();
-                    CRITICAL_BLOCK(cs_vNodes)
-                        BOOST_FOREACH(CNode* pnode, vNodes)
-                            if (setSeed.count(pnode->addr.ip))
-                                pnode->fDisconnect = true;
-                }
-
-                // Keep setting timestamps to 0 so they won't reconnect
-                if (GetTime() - nSeedDisconnected < 60 * 60)
-                {
-                    BOOST_FOREACH(PAIRTYPE(const vector<unsigned char>, CAddress)& item, mapAddresses)
-                    {
-                        if (setSeed.count(item.second.ip) && item.second.nTime != 0)
-                        {
-                            item.second.nTime = 0;
-                            CAddrDB().WriteAddress(item.second);
-                        }
-                    }
-                }
+                nSeedDisconnected = GetTime();
+                set<unsigned int> setAll(pnSeed, pnSeed + ARRAYLEN(pnSeed));
+                CRITICAL_BLOCK(cs_vNodes)
+                    BOOST_FOREACH(CNode* pnode, vNodes)
+                        if (setAll.count(pnode->addr.ip))
+                            pnode->fDisconnect = true;
             }
+            if (GetTime() - nSeedDisconnected < 60 * 60)
+                setSeed.insert(pnSeed, pnSeed + ARRAYLEN(pnSeed));
+        }
+
+        // Save the address table every so often
+        static int64 nLastDump;
+        if (nLastDump == 0)
+            nLastDump = GetTime();
+        if (GetTime() - nLastDump > 15 * 60)
+        {
+            DumpAddresses();
+            nLastDump = GetTime();
         }
 
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose an address to connect to
         //
         CAddress addrConnect;
-        int64 nBest = INT64_MIN;
 
         // Only connect to one address per a.b.?.? range.
-        // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
         set<unsigned int> setConnected;
         CRITICAL_BLOCK(cs_vNodes)
             BOOST_FOREACH(CNode* pnode, vNodes)
                 setConnected.insert(pnode->addr.ip & 0x0000ffff);
+        CRITICAL_BLOCK(cs_setConnecting)
+            BOOST_FOREACH(unsigned int ip, setConnecting)
+                setConnected.insert(ip & 0x0000ffff);
 
-        CRITICAL_BLOCK(cs_mapAddresses)
+        int64 nNow = GetAdjustedTime();
+        for (int nTries = 0; nTries < 100; nTries++)
         {
-            BOOST_FOREACH(const PAIRTYPE(vector<unsigned char>, CAddress)& item, mapAddresses)
-            {
-                const CAddress& addr = item.second;
-                if (!addr.IsIPv4() || !addr.IsValid() || setConnected.count(addr.ip & 0x0000ffff))
-                    continue;
-                int64 nSinceLastSeen = GetAdjustedTime() - addr.nTime;
-                int64 nSinceLastTry = GetAdjustedTime() - addr.nLastTry;
-
-                // Randomize the order in a deterministic way, putting the standard port first
-                int64 nRandomizer = (uint64)(nStart * 4951 + addr.nLastTry * 9567851 + addr.ip * 7789) % (2 * 60 * 60);
-                if (addr.port != htons(GetDefaultPort()))
-                    nRandomizer += 2 * 60 * 60;
-
-                // Last seen  Base retry frequency
-                //   <1 hour   10 min
-                //    1 hour    1 hour
-                //    4 hours   2 hours
-                //   24 hours   5 hours
-                //   48 hours   7 hours
-                //    7 days   13 hours
-                //   30 days   27 hours
-                //   90 days   46 hours
-                //  365 days   93 hours
-                int64 nDelay = (int64)(3600.0 * sqrt(fabs((double)nSinceLastSeen) / 3600.0) + nRandomizer);
-
-                // Fast reconnect for one hour after last seen
-                if (nSinceLastSeen < 60 * 60)
-                    nDelay = 10 * 60;
-
-                // Limit retry frequency
-                if (nSinceLastTry < nDelay)
-                    continue;
-
-                // If we have IRC, we'll be notified when they first come online,
-                // and again every 24 hours by the refresh broadcast.
-                if (nGotIRCAddresses > 0 && vNodes.size() >= 2 && nSinceLastSeen > 24 * 60 * 60)
-                    continue;
-
-                // Only try the old stuff if we don't have enough connections
-                if (vNodes.size() >= 8 && nSinceLastSeen > 24 * 60 * 60)
-                    continue;
-
-                // If multiple addresses are ready, prioritize by time since
-                // last seen and time since last tried.
-                int64 nScore = min(nSinceLastTry, (int64)24 * 60 * 60) - nSinceLastSeen - nRandomizer;
-                if (nScore > nBest)
-                {
-                    nBest = nScore;
-                    addrConnect = addr;
-                }
-            }
+            CAddress addr = addrman.Select();
+
+            // Only reached if the table is empty
+            if (!addr.IsValid())
+                break;
+
+            if (!addr.IsIPv4() || setConnected.count(addr.ip & 0x0000ffff) || setSeed.count(addr.ip))
+                continue;
+
+            // Don't retry anything we tried in the last ten minutes, unless
+            // there's nothing else to pick from
+            if (nNow - addr.nLastTry < 10 * 60 && nTries < 30)
+                continue;
+
+            // Put off addresses on a nonstandard port for a while
+            if (addr.port != htons(GetDefaultPort()) && nTries < 50)
+                continue;
+
+            addrConnect = addr;
+            break;
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect);
+            StartConnectAttempt(addrConnect);
     }
 }
 
@@ -1368,26 +2030,103 @@ void ThreadMessageHandler(void* parg)
     IMPLEMENT_RANDOMIZE_STACK(ThreadMessageHandler(parg));
     try
     {
-        vnThreadsRunning[2]++;
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]++;
         ThreadMessageHandler2(parg);
-        vnThreadsRunning[2]--;
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]--;
     }
     catch (std::exception& e) {
-        vnThreadsRunning[2]--;
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]--;
         PrintException(&e, "ThreadMessageHandler()");
     } catch (...) {
-        vnThreadsRunning[2]--;
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]--;
         PrintException(NULL, "ThreadMessageHandler()");
     }
     printf("ThreadMessageHandler exiting\n");
 }
 
+//
+// Several handler threads walk the node list.  A node is owned by at most
+// one of them at a time, so each peer's messages are still processed in
+// the order they arrived, while other peers make progress in parallel.
+//
+static bool ClaimNode(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+    {
+        if (pnode->fInService)
+            return false;
+        pnode->fInService = true;
+    }
+    return true;
+}
+
+static void UnclaimNode(CNode* pnode)
+{
+    CRITICAL_BLOCK(cs_vNodes)
+        pnode->fInService = false;
+}
+
+//
+// The socket thread wakes the handlers when a message has been framed or a
+// send buffer has drained.  Handlers still wake every 100ms without that,
+// for the inv trickle and the other timers in SendMessages.
+//
+static boost::mutex mutexMessageHandler;
+static boost::condition_variable condMessageHandler;
+static uint64 nMessageHandlerWakes = 0;
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+        nMessageHandlerWakes++;
+    }
+    condMessageHandler.notify_all();
+}
+
+static uint64 GetMessageHandlerWakes()
+{
+    boost::lock_guard<boost::mutex> lock(mutexMessageHandler);
+    return nMessageHandlerWakes;
+}
+
+// Wait up to nMilliseconds unless there has been a wakeup since nWakes
+static void WaitForMessageHandlerWake(uint64 nWakes, int64 nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(mutexMessageHandler);
+    if (nMessageHandlerWakes == nWakes && !fShutdown)
+        condMessageHandler.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+}
+
+// Only one handler picks a trickle node per 100ms, however many are running
+static bool TakeTrickleTurn()
+{
+    static CCriticalSection cs_trickle;
+    static int64 nNextTrickle;
+    CRITICAL_BLOCK(cs_trickle)
+    {
+        int64 nNow = GetTimeMillis();
+        if (nNow < nNextTrickle)
+            return false;
+        nNextTrickle = nNow + 100;
+    }
+    return true;
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
+        // Any wakeup after this point means another pass is needed
+        uint64 nWakes = GetMessageHandlerWakes();
+        bool fMoreWork = false;
+
         vector<CNode*> vNodesCopy;
         CRITICAL_BLOCK(cs_vNodes)
         {
@@ -1398,13 +2137,28 @@ void ThreadMessageHandler2(void* parg)
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (!vNodesCopy.empty() && TakeTrickleTurn())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+
+        // Start at a random node so the handlers spread out
+        int nStart = vNodesCopy.empty() ? 0 : GetRand(vNodesCopy.size());
+        for (int i = 0; i < vNodesCopy.size(); i++)
         {
+            CNode* pnode = vNodesCopy[(nStart + i) % vNodesCopy.size()];
+            if (!ClaimNode(pnode))
+                continue;
+
             // Receive messages
             TRY_CRITICAL_BLOCK(pnode->cs_vRecv)
+            {
+                // Processing may have queued relays for other nodes.  A
+                // peer with a full send queue is left alone until the
+                // socket thread wakes us.
+                unsigned int nRecvMsgBefore = pnode->vRecvMsg.size();
                 ProcessMessages(pnode);
+                if (pnode->vRecvMsg.size() < nRecvMsgBefore)
+                    fMoreWork = true;
+            }
             if (fShutdown)
                 return;
 
@@ -1413,6 +2167,8 @@ void ThreadMessageHandler2(void* parg)
                 SendMessages(pnode, pnode == pnodeTrickle);
             if (fShutdown)
                 return;
+
+            UnclaimNode(pnode);
         }
 
         CRITICAL_BLOCK(cs_vNodes)
@@ -1421,14 +2177,19 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        if (fMoreWork && !fRequestShutdown)
+            continue;
+
+        // Wait for more messages, a drained send buffer or the next timer.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[2]--;
-        Sleep(100);
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]--;
+        WaitForMessageHandlerWake(nWakes, 100);
         if (fRequestShutdown)
             Shutdown(NULL);
-        vnThreadsRunning[2]++;
+        CRITICAL_BLOCK(cs_vNodes)
+            vnThreadsRunning[2]++;
         if (fShutdown)
             return;
     }
@@ -1607,8 +2368,12 @@ void StartNode(void* parg)
         printf("Error: CreateThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!CreateThread(ThreadMessageHandler, NULL))
-        printf("Error: CreateThread(ThreadMessageHandler) failed\n");
+    int nMessageHandlers = GetArg("-msghandlers", min(4, max(1, (int)boost::thread::hardware_concurrency())));
+    nMessageHandlers = max(1, min(16, nMessageHandlers));
+    for (int i = 0; i < nMessageHandlers; i++)
+        if (!CreateThread(ThreadMessageHandler, NULL))
+            printf("Error: CreateThread(ThreadMessageHandler) failed\n");
+    printf("Using %d message handler threads\n", nMessageHandlers);
 
     // Generate coins in the background
     GenerateBitcoins(fGenerateBitcoins);
@@ -1619,8 +2384,10 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    WakeMessageHandler();
+    WakeScriptCheckThreads();
     int64 nStart = GetTime();
-    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0
+    while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0 || vnThreadsRunning[6] > 0 || GetConnectingCount() > 0
 #ifdef USE_UPNP
         || vnThreadsRunning[5] > 0
 #endif
@@ -1632,10 +2399,12 @@ bool StopNode()
     }
     if (vnThreadsRunning[0] > 0) printf("ThreadSocketHandler still running\n");
     if (vnThreadsRunning[1] > 0) printf("ThreadOpenConnections still running\n");
+    if (GetConnectingCount() > 0) printf("ThreadConnectAttempt still running\n");
     if (vnThreadsRunning[2] > 0) printf("ThreadMessageHandler still running\n");
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
     if (fHaveUPnP && vnThreadsRunning[5] > 0) printf("ThreadMapPort still running\n");
+    if (vnThreadsRunning[6] > 0) printf("ThreadScriptCheck still running\n");
     while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
         Sleep(20);
     Sleep(50);
@@ -37,6 +37,7 @@ bool Lookup(const char *pszName, std::vector<CAddress>& vaddr, int nServices, in
 bool Lookup(const char *pszName, CAddress& addr, int nServices, bool fAllowLookup = false, int portDefault = 0, bool fAllowPort = false);
 bool GetMyExternalIP(unsigned int& ipRet);
 bool AddAddress(CAddress addr, int64 nTimePenalty=0);
+bool AddAddress(CAddress addr, int64 nTimePenalty, const CAddress& addrSource);
 void AddressCurrentlyConnected(const CAddress& addr);
 CNode* FindNode(unsigned int ip);
 CNode* ConnectNode(CAddress addrConnect, int64 nTimeout=0);
@@ -47,6 +48,7 @@ void DNSAddressSeed();
 bool BindListenPort(std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void WakeMessageHandler();
 
 
 
@@ -347,6 +349,7 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_CMPCT_BLOCK,
 };
 
 static const char* ppszTypeName[] =
@@ -354,6 +357,7 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
+    "cmpctblock",
 };
 
 class CInv
@@ -401,6 +405,11 @@ public:
         return (a.type < b.type || (a.type == b.type && a.hash < b.hash));
     }
 
+    friend inline bool operator==(const CInv& a, const CInv& b)
+    {
+        return (a.type == b.type && a.hash == b.hash);
+    }
+
     bool IsKnownType() const
     {
         return (type >= 1 && type < ARRAYLEN(ppszTypeName));
@@ -424,6 +433,11 @@ public:
     }
 };
 
+inline size_t CSaltedHasher::operator()(const CInv& inv) const
+{
+    return (size_t)inv.hash.GetHash(nKey0, nKey1, inv.type);
+}
+
 
 
 
@@ -450,6 +464,173 @@ public:
 
 
 
+// A message as it comes off the wire.  The socket thread fills in the
+// header, then the payload into a buffer that grows as the bytes arrive,
+// so a header can't make us allocate more than the peer actually sends.
+// Finished messages are handed to ProcessMessages as they are, so nothing
+// is ever searched, shifted or copied again.
+class CNetMessage
+{
+public:
+    bool fInData;
+    CDataStream hdrbuf;
+    unsigned int nHdrPos;
+    CMessageHeader hdr;
+    CDataStream vRecv;
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(::GetSerializeSize(CMessageHeader(), nTypeIn, nVersionIn));
+        nHdrPos = 0;
+        fInData = false;
+        nDataPos = 0;
+    }
+
+    bool IsComplete() const
+    {
+        return (fInData && nDataPos == hdr.nMessageSize);
+    }
+
+    unsigned int GetAllocatedSize() const
+    {
+        return hdrbuf.size() + vRecv.size();
+    }
+
+    int ReadHeader(const char* pch, unsigned int nBytes);
+    int ReadData(const char* pch, unsigned int nBytes);
+    unsigned int GetChecksum() const;
+};
+
+
+
+
+
+//
+// Address manager
+//
+// Addresses we've heard about go into "new" buckets picked from their /16
+// range and the /16 range of the peer that told us, so one peer can only
+// fill a few buckets however much it sends.  Addresses we've connected to
+// move to "tried" buckets.  Both tables have a fixed number of slots, a
+// newcomer only pushes out an entry that isn't worth keeping.
+//
+static const int ADDRMAN_NEW_BUCKETS = 256;
+static const int ADDRMAN_TRIED_BUCKETS = 64;
+static const int ADDRMAN_BUCKET_SIZE = 64;
+
+class CAddrInfo : public CAddress
+{
+public:
+    unsigned int nSourceIP;
+    int64 nLastSuccess;
+    int nAttempts;
+    bool fInTried;
+
+    // memory only, position in its table's random slots
+    int nRandomPos;
+
+    CAddrInfo()
+    {
+        SetNull();
+    }
+
+    CAddrInfo(const CAddress& addr, unsigned int nSourceIPIn) : CAddress(addr)
+    {
+        SetNull();
+        nSourceIP = nSourceIPIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(*(CAddress*)this);
+        READWRITE(nLastTry);
+        READWRITE(nSourceIP);
+        READWRITE(nLastSuccess);
+        READWRITE(nAttempts);
+        READWRITE(fInTried);
+    )
+
+    void SetNull()
+    {
+        nSourceIP = 0;
+        nLastSuccess = 0;
+        nAttempts = 0;
+        fInTried = false;
+        nRandomPos = -1;
+    }
+
+    bool IsTerrible(int64 nNow) const;
+    double GetChance(int64 nNow) const;
+};
+
+class CAddrMan
+{
+public:
+    CAddrMan();
+
+    bool Add(const CAddress& addr, const CAddress& addrSource, int64 nTimePenalty=0);
+    void Good(const CAddress& addr);
+    void Attempt(const CAddress& addr);
+    void Connected(const CAddress& addr);
+    CAddress Select();
+    std::vector<CAddress> GetAddr();
+    int size();
+
+    // Only the entries are stored, the buckets are rebuilt from nKey
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        CRITICAL_BLOCK(cs)
+        {
+            std::vector<CAddrInfo> vInfo;
+            vInfo.reserve(mapInfo.size());
+            for (std::map<int, CAddrInfo>::const_iterator mi = mapInfo.begin(); mi != mapInfo.end(); ++mi)
+                vInfo.push_back((*mi).second);
+            s << nKey << vInfo;
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        uint256 nKeyIn;
+        std::vector<CAddrInfo> vInfo;
+        s >> nKeyIn >> vInfo;
+        CRITICAL_BLOCK(cs)
+            Load(nKeyIn, vInfo);
+    }
+
+private:
+    mutable CCriticalSection cs;
+    uint256 nKey;
+    std::map<int, CAddrInfo> mapInfo;
+    std::map<uint64, int> mapAddr;
+    std::vector<int> vRandomNew;
+    std::vector<int> vRandomTried;
+    int nIdCount;
+    int vvNew[ADDRMAN_NEW_BUCKETS][ADDRMAN_BUCKET_SIZE];
+    int vvTried[ADDRMAN_TRIED_BUCKETS][ADDRMAN_BUCKET_SIZE];
+
+    void Clear();
+    void Load(const uint256& nKeyIn, const std::vector<CAddrInfo>& vInfo);
+    uint64 GetKeyedHash(uint64 n1, uint64 n2, uint64 n3) const;
+    int GetNewBucket(const CAddrInfo& info) const;
+    int GetTriedBucket(const CAddrInfo& info) const;
+    int GetBucketPos(bool fNew, int nBucket, const CAddrInfo& info) const;
+    void AddRandom(int nId);
+    void RemoveRandom(int nId);
+    CAddrInfo* Find(const CAddress& addr, int* pnId=NULL);
+    int Create(const CAddrInfo& info);
+    void Delete(int nId);
+    bool PlaceNew(int nId);
+    void MakeTried(int nId);
+};
+
+
+
+
+
 extern bool fClient;
 extern bool fAllowDNS;
 extern uint64 nLocalServices;
@@ -461,12 +642,12 @@ extern SOCKET hListenSocket;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<std::vector<unsigned char>, CAddress> mapAddresses;
-extern CCriticalSection cs_mapAddresses;
-extern std::map<CInv, CDataStream> mapRelay;
+extern int64 nLastNodeId;
+extern CAddrMan addrman;
+extern boost::unordered_map<CInv, CDataStream, CSaltedHasher> mapRelay;
 extern std::deque<std::pair<int64, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
-extern std::map<CInv, int64> mapAlreadyAskedFor;
+extern boost::unordered_map<CInv, int64, CSaltedHasher> mapAlreadyAskedFor;
 
 // Settings
 extern int fUseProxy;
@@ -475,6 +656,34 @@ extern CAddress addrProxy;
 
 
 
+// Send queue classes, each queue is sent before the ones after it
+enum
+{
+    SEND_CONTROL,
+    SEND_RELAY,
+    SEND_BULK,
+    SEND_CLASSES,
+};
+
+inline int GetSendClass(const char* pszCommand)
+{
+    if (strcmp(pszCommand, "block") == 0 || strcmp(pszCommand, "blocktxn") == 0)
+        return SEND_BULK;
+    if (strcmp(pszCommand, "inv") == 0 || strcmp(pszCommand, "tx") == 0 ||
+        strcmp(pszCommand, "addr") == 0 || strcmp(pszCommand, "cmpctblock") == 0)
+        return SEND_RELAY;
+    return SEND_CONTROL;
+}
+
+// Per-peer filters of addresses and inventory the peer already has.  A
+// false positive only means the peer doesn't hear about that item from us.
+static const unsigned int ADDR_KNOWN_ELEMENTS = 5000;
+static const double ADDR_KNOWN_FP_RATE = 0.001;
+static const unsigned int INVENTORY_KNOWN_ELEMENTS = 50000;
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
+
+// Queued bytes at which we stop answering a peer until it reads some
+inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 
 
 class CNode
@@ -484,7 +693,14 @@ public:
     uint64 nServices;
     SOCKET hSocket;
     CDataStream vSend;
-    CDataStream vRecv;
+    std::deque<std::vector<char> > vSendQueue[SEND_CLASSES];
+    std::vector<char> vchSending;
+    unsigned int nSendOffset;
+    unsigned int nSendSize;
+    int nSendClass;
+    std::deque<CNetMessage> vRecvMsg;
+    std::deque<CInv> vRecvGetData;
+    int nRecvVersion;
     CCriticalSection cs_vSend;
     CCriticalSection cs_vRecv;
     int64 nLastSend;
@@ -501,6 +717,17 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+
+    // socket readiness, only touched by the socket handler thread
+    bool fRecvReady;
+    bool fSendReady;
+    bool fPollRegistered;
+
+    // set while a message handler thread owns this node, guarded by cs_vNodes
+    bool fInService;
+
+    // unique for the life of the process, unlike the node's address
+    int64 nId;
 protected:
     int nRefCount;
 public:
@@ -514,12 +741,16 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    std::set<CAddress> setAddrKnown;
+    CRollingBloomFilter filterAddrKnown;
+    CCriticalSection cs_addr;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
+    // block relay
+    bool fCompactBlocks;
+
     // inventory based relay
-    std::set<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64, CInv> mapAskFor;
@@ -528,19 +759,23 @@ public:
     std::vector<char> vfSubscribe;
 
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false)
+    CNode(SOCKET hSocketIn, CAddress addrIn, bool fInboundIn=false) :
+        filterAddrKnown(ADDR_KNOWN_ELEMENTS, ADDR_KNOWN_FP_RATE),
+        filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FP_RATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
         vSend.SetType(SER_NETWORK);
         vSend.SetVersion(0);
-        vRecv.SetType(SER_NETWORK);
-        vRecv.SetVersion(0);
+        nSendOffset = 0;
+        nSendSize = 0;
+        nSendClass = SEND_CONTROL;
+        nRecvVersion = 0;
         // Version 0.2 obsoletes 20 Feb 2012
         if (GetTime() > 1329696000)
         {
             vSend.SetVersion(209);
-            vRecv.SetVersion(209);
+            nRecvVersion = 209;
         }
         nLastSend = 0;
         nLastRecv = 0;
@@ -556,6 +791,12 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fPollRegistered = false;
+        fInService = false;
+        CRITICAL_BLOCK(cs_vNodes)
+            nId = nLastNodeId++;
         nRefCount = 0;
         nReleaseTime = 0;
         hashContinue = 0;
@@ -563,6 +804,7 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fGetAddr = false;
+        fCompactBlocks = false;
         vfSubscribe.assign(256, false);
 
         // Be shy and don't send version until we hear
@@ -606,9 +848,23 @@ public:
 
 
 
+    // The known address filter is keyed by ip and port
+    static uint256 GetAddrKnownKey(const CAddress& addr)
+    {
+        return uint256((uint64)addr.ip | ((uint64)addr.port << 32));
+    }
+
+    bool IsAddressKnown(const CAddress& addr)
+    {
+        CRITICAL_BLOCK(cs_addr)
+            return filterAddrKnown.contains(GetAddrKnownKey(addr));
+        return false;
+    }
+
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        CRITICAL_BLOCK(cs_addr)
+            filterAddrKnown.insert(GetAddrKnownKey(addr));
     }
 
     void PushAddress(const CAddress& addr)
@@ -616,21 +872,22 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr))
-            vAddrToSend.push_back(addr);
+        CRITICAL_BLOCK(cs_addr)
+            if (addr.IsValid() && !IsAddressKnown(addr))
+                vAddrToSend.push_back(addr);
     }
 
 
     void AddInventoryKnown(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
     }
 
     void PushInventory(const CInv& inv)
     {
         CRITICAL_BLOCK(cs_inventory)
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
     }
 
@@ -661,6 +918,7 @@ public:
         nHeaderStart = vSend.size();
         vSend << CMessageHeader(pszCommand, 0);
         nMessageStart = vSend.size();
+        nSendClass = GetSendClass(pszCommand);
         if (fDebug)
             printf("%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
         printf("sending: %s ", pszCommand);
@@ -706,6 +964,11 @@ public:
         printf("(%d bytes) ", nSize);
         printf("\n");
 
+        // Hand the finished message to the socket thread
+        vSendQueue[nSendClass].push_back(std::vector<char>(vSend.begin() + nHeaderStart, vSend.end()));
+        nSendSize += vSend.size() - nHeaderStart;
+        vSend.resize(nHeaderStart);
+
         nHeaderStart = -1;
         nMessageStart = -1;
         cs_vSend.Leave();
@@ -768,6 +1031,25 @@ public:
         }
     }
 
+    // Queue in a given send class, for a message that must keep its
+    // place behind what was already queued there
+    template<typename T1>
+    void PushMessageClass(int nClass, const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            nSendClass = nClass;
+            vSend << a1;
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -941,6 +1223,16 @@ public:
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fCompleteRet);
+
+    bool IsSendQueueFull()
+    {
+        CRITICAL_BLOCK(cs_vSend)
+            return nSendSize >= SendBufferSize();
+        return false;
+    }
+
+    unsigned int GetTotalRecvSize() const;
     void CloseSocketDisconnect();
     void Cleanup();
 };
@@ -295,6 +295,48 @@ Value getinfo(const Array& params, bool fHelp)
 }
 
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns an object containing signature cache statistics.");
+
+    int64 nHits, nMisses;
+    int nSize;
+    GetSignatureCacheStats(nHits, nMisses, nSize);
+
+    Object obj;
+    obj.push_back(Pair("size",          nSize));
+    obj.push_back(Pair("maxsize",       (boost::int64_t)GetArg("-maxsigcachesize", 50000)));
+    obj.push_back(Pair("hits",          (boost::int64_t)nHits));
+    obj.push_back(Pair("misses",        (boost::int64_t)nMisses));
+    return obj;
+}
+
+
+Value getblockcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockcacheinfo\n"
+            "Returns an object containing statistics for the cache of recently served blocks.");
+
+    int64 nHits, nMisses, nBytes;
+    int nBlocks;
+    GetRawBlockCacheStats(nHits, nMisses, nBlocks, nBytes);
+
+    Object obj;
+    obj.push_back(Pair("blocks",        nBlocks));
+    obj.push_back(Pair("bytes",         (boost::int64_t)nBytes));
+    obj.push_back(Pair("maxbytes",      (boost::int64_t)GetArg("-blockcachesize", 8) * 1000000));
+    obj.push_back(Pair("hits",          (boost::int64_t)nHits));
+    obj.push_back(Pair("misses",        (boost::int64_t)nMisses));
+    obj.push_back(Pair("hitratio",      (nHits + nMisses) ? (double)nHits / (nHits + nMisses) : 0.0));
+    return obj;
+}
+
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -333,7 +375,7 @@ string GetAccountAddress(string strAccount, bool bForceNew=false)
     {
         CScript scriptPubKey;
         scriptPubKey.SetBitcoinAddress(account.vchPubKey);
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin();
+        for (WalletMap::iterator it = mapWallet.begin();
              it != mapWallet.end() && !account.vchPubKey.empty();
              ++it)
         {
@@ -537,7 +579,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
     int64 nAmount = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (wtx.IsCoinBase() || !wtx.IsFinal())
@@ -596,7 +638,7 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
     int64 nAmount = 0;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (wtx.IsCoinBase() || !wtx.IsFinal())
@@ -619,7 +661,7 @@ int64 GetAccountBalance(CWalletDB& walletdb, const string& strAccount, int nMinD
     CRITICAL_BLOCK(cs_mapWallet)
     {
         // Tally wallet transactions
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (!wtx.IsFinal())
@@ -667,7 +709,7 @@ Value getbalance(const Array& params, bool fHelp)
         // (GetBalance() sums up all unspent TxOuts)
         // getbalance and getbalance '*' should always return the same number.
         int64 nBalance = 0;
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (!wtx.IsFinal())
@@ -877,7 +919,7 @@ Value ListReceived(const Array& params, bool fByAccounts)
     map<uint160, tallyitem> mapTally;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             if (wtx.IsCoinBase() || !wtx.IsFinal())
@@ -1109,7 +1151,7 @@ Value listtransactions(const Array& params, bool fHelp)
         typedef multimap<int64, TxPair > TxItems;
         TxItems txByTime;
 
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             CWalletTx* wtx = &((*it).second);
             txByTime.insert(make_pair(wtx->GetTxTime(), TxPair(wtx, (CAccountingEntry*)0)));
@@ -1170,7 +1212,7 @@ Value listaccounts(const Array& params, bool fHelp)
                 mapAccountBalances[entry.second] = 0;
         }
 
-        for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
         {
             const CWalletTx& wtx = (*it).second;
             int64 nGeneratedImmature, nGeneratedMature, nFee;
@@ -1417,6 +1459,8 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("setgenerate",           &setgenerate),
     make_pair("gethashespersec",       &gethashespersec),
     make_pair("getinfo",               &getinfo),
+    make_pair("getsigcacheinfo",       &getsigcacheinfo),
+    make_pair("getblockcacheinfo",     &getblockcacheinfo),
     make_pair("getnewaddress",         &getnewaddress),
     make_pair("getaccountaddress",     &getaccountaddress),
     make_pair("setaccount",            &setaccount),
@@ -1460,6 +1504,8 @@ string pAllowInSafeMode[] =
     "setgenerate",
     "gethashespersec",
     "getinfo",
+    "getsigcacheinfo",
+    "getblockcacheinfo",
     "getnewaddress",
     "getaccountaddress",
     "setlabel",
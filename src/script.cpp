@@ -933,13 +933,90 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+//
+// Signatures that have already been verified, so a transaction that was
+// checked when it entered the memory pool costs nothing to check again
+// when its block is connected.  Only valid signatures are remembered.
+//
+class CSignatureCache
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
+private:
+    // sighash, pubkey, signature
+    typedef boost::tuple<uint256, vector<unsigned char>, vector<unsigned char> > sigdata_type;
+    set<sigdata_type> setValid;
+    CCriticalSection cs_sigcache;
+
+public:
+    int64 nHits;
+    int64 nMisses;
+
+    CSignatureCache()
+    {
+        nHits = 0;
+        nMisses = 0;
+    }
+
+    bool Get(uint256 hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            if (setValid.count(boost::make_tuple(hash, vchPubKey, vchSig)))
+            {
+                nHits++;
+                return true;
+            }
+            nMisses++;
+        }
         return false;
+    }
+
+    void Set(uint256 hash, const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey)
+    {
+        unsigned int nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize == 0)
+            return;
+
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            while (setValid.size() >= nMaxCacheSize)
+            {
+                // Evict a random entry.  Random because that helps
+                // foil would-be DoS attackers who might try to pre-generate
+                // and re-use a set of valid signatures just-slightly-greater
+                // than our cache size.
+                uint256 hashRandom;
+                RAND_bytes((unsigned char*)&hashRandom, sizeof(hashRandom));
+                set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(hashRandom, vector<unsigned char>(), vector<unsigned char>()));
+                if (it == setValid.end())
+                    it = setValid.begin();
+                setValid.erase(it);
+            }
+            setValid.insert(boost::make_tuple(hash, vchPubKey, vchSig));
+        }
+    }
 
+    void GetStats(int64& nHitsRet, int64& nMissesRet, int& nSizeRet)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            nHitsRet = nHits;
+            nMissesRet = nMisses;
+            nSizeRet = setValid.size();
+        }
+    }
+};
+
+static CSignatureCache sigcache;
+
+void GetSignatureCacheStats(int64& nHits, int64& nMisses, int& nSize)
+{
+    sigcache.GetStats(nHits, nMisses, nSize);
+}
+
+
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
         return false;
@@ -949,7 +1026,18 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    uint256 hash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    if (sigcache.Get(hash, vchSig, vchPubKey))
+        return true;
+
+    CKey key;
+    if (!key.SetPubKey(vchPubKey))
+        return false;
+    if (!key.Verify(hash, vchSig))
+        return false;
+
+    sigcache.Set(hash, vchSig, vchPubKey);
+    return true;
 }
 
 
@@ -1196,6 +1284,14 @@ bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsig
     if (txin.prevout.hash != txFrom.GetHash())
         return false;
 
+    return VerifySignature(txout, txTo, nIn, nHashType);
+}
+
+bool VerifySignature(const CTxOut& txout, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    assert(nIn < txTo.vin.size());
+    const CTxIn& txin = txTo.vin[nIn];
+
     if (!VerifyScript(txin.scriptSig, txout.scriptPubKey, txTo, nIn, nHashType))
         return false;
 
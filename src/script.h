@@ -10,6 +10,7 @@
 #include <vector>
 
 class CTransaction;
+class CTxOut;
 
 enum
 {
@@ -713,6 +714,9 @@ bool IsMine(const CScript& scriptPubKey);
 bool ExtractPubKey(const CScript& scriptPubKey, bool fMineOnly, std::vector<unsigned char>& vchPubKeyRet);
 bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret);
 bool SignSignature(const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL, CScript scriptPrereq=CScript());
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
+bool VerifySignature(const CTxOut& txout, const CTransaction& txTo, unsigned int nIn, int nHashType=0);
+void GetSignatureCacheStats(int64& nHits, int64& nMisses, int& nSize);
 
 #endif
@@ -0,0 +1,234 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Microbenchmarks, one line of timings and memory per case
+//
+
+#include "../headers.h"
+
+using namespace std;
+
+//
+// Allocator that keeps a running total of the bytes containers ask for,
+// which is what a container costs minus the malloc overhead per block
+//
+static int64 nAllocated = 0;
+
+template<typename T>
+struct counting_allocator : public std::allocator<T>
+{
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type  difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    counting_allocator() throw() {}
+    counting_allocator(const counting_allocator& a) throw() : base(a) {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>& a) throw() : base(a) {}
+    ~counting_allocator() throw() {}
+    template<typename _Other> struct rebind
+    { typedef counting_allocator<_Other> other; };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        nAllocated += sizeof(T) * n;
+        return std::allocator<T>::allocate(n, hint);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        nAllocated -= sizeof(T) * n;
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+static int64 GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    RAND_bytes((unsigned char*)&hash, sizeof(hash));
+    return hash;
+}
+
+static void PrintResult(const char* pszName, int nOps, int64 nMicros, int64 nBytes, int nEntries)
+{
+    printf("%-48s %8.1f ns/op %10"PRI64d" bytes %7.1f bytes/entry\n", pszName,
+        1000.0 * nMicros / max(nOps, 1), nBytes, (double)nBytes / max(nEntries, 1));
+}
+
+
+
+//
+// Known inventory: the old per-peer std::set<CInv> against the rolling
+// bloom filter, over a long-lived peer's worth of announcements.  Each
+// announcement is checked and then recorded, as PushInventory does.
+//
+static void BenchInventoryKnown(int nInvs)
+{
+    vector<CInv> vInv(nInvs);
+    for (int i = 0; i < nInvs; i++)
+        vInv[i] = CInv(MSG_TX, RandomHash());
+
+    {
+        nAllocated = 0;
+        set<CInv, less<CInv>, counting_allocator<CInv> > setInventoryKnown;
+        int64 nStart = GetTimeMicros();
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (!setInventoryKnown.count(inv))
+                setInventoryKnown.insert(inv);
+        int64 nMicros = GetTimeMicros() - nStart;
+        PrintResult(strprintf("set<CInv> known inventory, %d invs", nInvs).c_str(), nInvs, nMicros, nAllocated, setInventoryKnown.size());
+    }
+
+    {
+        CRollingBloomFilter filterInventoryKnown(INVENTORY_KNOWN_ELEMENTS, INVENTORY_KNOWN_FP_RATE);
+        int64 nStart = GetTimeMicros();
+        BOOST_FOREACH(const CInv& inv, vInv)
+            if (!filterInventoryKnown.contains(inv.hash))
+                filterInventoryKnown.insert(inv.hash);
+        int64 nMicros = GetTimeMicros() - nStart;
+        PrintResult(strprintf("rolling bloom known inventory, %d invs", nInvs).c_str(), nInvs, nMicros, filterInventoryKnown.GetMemoryUsage(), min(nInvs, (int)INVENTORY_KNOWN_ELEMENTS));
+    }
+}
+
+
+
+//
+// Hash keyed maps: std::map as the big maps used to be against the salted
+// boost::unordered_map they are now, with the key and value types of
+// mapBlockIndex, mapNextTx and mapAlreadyAskedFor
+//
+template<typename Map>
+static void BenchMap(const string& strName, const vector<typename Map::key_type>& vKey)
+{
+    typedef typename Map::key_type Key;
+    nAllocated = 0;
+    Map mapTest;
+
+    int64 nStart = GetTimeMicros();
+    BOOST_FOREACH(const Key& key, vKey)
+        mapTest.insert(make_pair(key, typename Map::mapped_type()));
+    int64 nInsertMicros = GetTimeMicros() - nStart;
+    int64 nBytes = nAllocated;
+
+    // Look every key up a few times, in a different order than inserted
+    vector<Key> vLookup(vKey);
+    random_shuffle(vLookup.begin(), vLookup.end(), GetRandInt);
+    int nFound = 0;
+    nStart = GetTimeMicros();
+    for (int n = 0; n < 4; n++)
+        BOOST_FOREACH(const Key& key, vLookup)
+            nFound += mapTest.count(key);
+    int64 nLookupMicros = GetTimeMicros() - nStart;
+    if (nFound != 4 * mapTest.size())
+        printf("%s : lookups found %d of %d\n", strName.c_str(), nFound, 4 * mapTest.size());
+
+    PrintResult((strName + " insert").c_str(), vKey.size(), nInsertMicros, nBytes, mapTest.size());
+    PrintResult((strName + " lookup").c_str(), 4 * vLookup.size(), nLookupMicros, nBytes, mapTest.size());
+}
+
+static void BenchHashMaps(int nEntries)
+{
+    vector<uint256> vHash(nEntries);
+    vector<COutPoint> vOutPoint(nEntries);
+    vector<CInv> vInv(nEntries);
+    for (int i = 0; i < nEntries; i++)
+    {
+        vHash[i] = RandomHash();
+        vOutPoint[i] = COutPoint(vHash[i], i % 3);
+        vInv[i] = CInv(MSG_TX, vHash[i]);
+    }
+
+    typedef pair<const uint256, CBlockIndex*> BlockIndexEntry;
+    typedef pair<const COutPoint, CInPoint> NextTxEntry;
+    typedef pair<const CInv, int64> AskedForEntry;
+
+    string strSize = strprintf(", %d", nEntries);
+    BenchMap<map<uint256, CBlockIndex*, less<uint256>, counting_allocator<BlockIndexEntry> > >("map<uint256, CBlockIndex*>" + strSize, vHash);
+    BenchMap<boost::unordered_map<uint256, CBlockIndex*, CSaltedHasher, equal_to<uint256>, counting_allocator<BlockIndexEntry> > >("salted uint256 -> CBlockIndex*" + strSize, vHash);
+    BenchMap<map<COutPoint, CInPoint, less<COutPoint>, counting_allocator<NextTxEntry> > >("map<COutPoint, CInPoint>" + strSize, vOutPoint);
+    BenchMap<boost::unordered_map<COutPoint, CInPoint, CSaltedHasher, equal_to<COutPoint>, counting_allocator<NextTxEntry> > >("salted COutPoint -> CInPoint" + strSize, vOutPoint);
+    BenchMap<map<CInv, int64, less<CInv>, counting_allocator<AskedForEntry> > >("map<CInv, int64>" + strSize, vInv);
+    BenchMap<boost::unordered_map<CInv, int64, CSaltedHasher, equal_to<CInv>, counting_allocator<AskedForEntry> > >("salted CInv -> int64" + strSize, vInv);
+}
+
+
+
+//
+// Coinbase maturity for a block spending many mined outputs, like a pool
+// paying out.  Before the height was kept, each such input walked back
+// COINBASE_MATURITY block index entries looking for the position of the
+// block the coinbase came from; now it's a subtraction.
+//
+static void BenchCoinbaseMaturity(int nInputs)
+{
+    // The block being connected and the chain behind it
+    int nChain = 2000;
+    vector<CBlockIndex> vIndex(nChain);
+    for (int i = 0; i < nChain; i++)
+    {
+        vIndex[i].pprev = (i > 0 ? &vIndex[i-1] : NULL);
+        vIndex[i].nHeight = i;
+        vIndex[i].nFile = 1;
+        vIndex[i].nBlockPos = 1 + i * 250000;
+    }
+    CBlockIndex* pindexBlock = &vIndex.back();
+
+    // Coinbases of random matured blocks
+    vector<CTxIndex> vTxIndex(nInputs);
+    for (int i = 0; i < nInputs; i++)
+    {
+        int nHeight = GetRandInt(nChain - COINBASE_MATURITY);
+        const CBlockIndex& index = vIndex[nHeight];
+        vTxIndex[i] = CTxIndex(CDiskTxPos(index.nFile, index.nBlockPos, index.nBlockPos + 81), nHeight);
+    }
+
+    int nRounds = 100;
+    int nImmature = 0;
+    int64 nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+        BOOST_FOREACH(const CTxIndex& txindex, vTxIndex)
+            for (CBlockIndex* pindex = pindexBlock; pindex && pindexBlock->nHeight - pindex->nHeight < COINBASE_MATURITY; pindex = pindex->pprev)
+                if (pindex->nBlockPos == txindex.pos.nBlockPos && pindex->nFile == txindex.pos.nFile)
+                    nImmature++;
+    int64 nWalkMicros = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int n = 0; n < nRounds; n++)
+        BOOST_FOREACH(const CTxIndex& txindex, vTxIndex)
+            if (pindexBlock->nHeight - txindex.nHeight < COINBASE_MATURITY)
+                nImmature++;
+    int64 nHeightMicros = GetTimeMicros() - nStart;
+    if (nImmature != 0)
+        printf("coinbase maturity : %d inputs wrongly immature\n", nImmature);
+
+    PrintResult(strprintf("maturity by block walk, %d inputs", nInputs).c_str(), nRounds * nInputs, nWalkMicros, 0, nInputs);
+    PrintResult(strprintf("maturity by stored height, %d inputs", nInputs).c_str(), nRounds * nInputs, nHeightMicros, 0, nInputs);
+}
+
+
+
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+
+    BenchInventoryKnown(10000);
+    BenchInventoryKnown(INVENTORY_KNOWN_ELEMENTS);
+    BenchInventoryKnown(500000);
+    BenchHashMaps(100000);
+    BenchHashMaps(1000000);
+    BenchCoinbaseMaturity(100);
+    BenchCoinbaseMaturity(2000);
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for CRollingBloomFilter and the keyed hash behind it, returns
+// nonzero if any check fails
+//
+
+#include "../headers.h"
+
+using namespace std;
+
+static int nFailures = 0;
+
+#define CHECK(expr)                                                        \
+    do {                                                                   \
+        if (!(expr))                                                       \
+        {                                                                  \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            nFailures++;                                                   \
+        }                                                                  \
+    } while (0)
+
+static uint256 RandomHash()
+{
+    uint256 hash;
+    RAND_bytes((unsigned char*)&hash, sizeof(hash));
+    return hash;
+}
+
+static vector<uint256> RandomHashes(int nCount)
+{
+    vector<uint256> vHash(nCount);
+    for (int i = 0; i < nCount; i++)
+        vHash[i] = RandomHash();
+    return vHash;
+}
+
+// Fraction of never inserted keys the filter claims to have
+static double MeasureFPRate(const CRollingBloomFilter& filter, int nTrials)
+{
+    int nHits = 0;
+    for (int i = 0; i < nTrials; i++)
+        if (filter.contains(RandomHash()))
+            nHits++;
+    return (double)nHits / nTrials;
+}
+
+// The last nElements keys are always found, however many came before
+static void TestNoFalseNegatives(unsigned int nElements)
+{
+    CRollingBloomFilter filter(nElements, 0.001);
+    vector<uint256> vHash = RandomHashes(nElements * 10);
+    int nMissing = 0;
+    for (int i = 0; i < vHash.size(); i++)
+    {
+        filter.insert(vHash[i]);
+
+        // Check the whole window at a spread of points around rollovers
+        if (i % (nElements / 7 + 1) == 0 || i == vHash.size() - 1)
+            for (int j = max(0, i + 1 - (int)nElements); j <= i; j++)
+                if (!filter.contains(vHash[j]))
+                    nMissing++;
+    }
+    CHECK(nMissing == 0);
+}
+
+// Keys from three generations back are dropped on rollover
+static void TestRollover(unsigned int nElements, double dFPRate)
+{
+    CRollingBloomFilter filter(nElements, dFPRate);
+    vector<uint256> vOld = RandomHashes(nElements);
+    BOOST_FOREACH(const uint256& hash, vOld)
+        filter.insert(hash);
+    BOOST_FOREACH(const uint256& hash, vOld)
+        CHECK(filter.contains(hash));
+
+    // Another three half-size generations push out everything above
+    vector<uint256> vNew = RandomHashes(nElements * 3 / 2 + 2);
+    BOOST_FOREACH(const uint256& hash, vNew)
+        filter.insert(hash);
+    int nRemembered = 0;
+    BOOST_FOREACH(const uint256& hash, vOld)
+        if (filter.contains(hash))
+            nRemembered++;
+
+    // What's left can only be false positives
+    CHECK(nRemembered <= 10 + 5 * dFPRate * vOld.size());
+}
+
+// At its fullest the filter stays within the requested rate
+static void TestFPRate(unsigned int nElements, double dFPRate)
+{
+    CRollingBloomFilter filter(nElements, dFPRate);
+    int nTrials = max(100000, (int)(100 / dFPRate));
+
+    // Two full generations and a nearly full third is the worst case
+    vector<uint256> vHash = RandomHashes(nElements * 3 / 2 - 1);
+    BOOST_FOREACH(const uint256& hash, vHash)
+        filter.insert(hash);
+    double dMeasured = MeasureFPRate(filter, nTrials);
+    printf("nElements=%u dFPRate=%g measured=%g (%u bytes)\n", nElements, dFPRate, dMeasured, filter.GetMemoryUsage());
+
+    // Allow for sampling noise on top of the target
+    CHECK(dMeasured <= dFPRate * 1.2 + 3 * sqrt(dFPRate / nTrials));
+}
+
+static void TestClear()
+{
+    CRollingBloomFilter filter(1000, 0.001);
+    vector<uint256> vHash = RandomHashes(1200);
+    BOOST_FOREACH(const uint256& hash, vHash)
+        filter.insert(hash);
+    filter.clear();
+    int nRemembered = 0;
+    BOOST_FOREACH(const uint256& hash, vHash)
+        if (filter.contains(hash))
+            nRemembered++;
+    CHECK(nRemembered <= 10);
+
+    // Still works normally afterwards
+    BOOST_FOREACH(const uint256& hash, vHash)
+        filter.insert(hash);
+    for (int i = vHash.size() - 1000; i < vHash.size(); i++)
+        CHECK(filter.contains(vHash[i]));
+}
+
+// Test vector from the SipHash paper: key 00..0f, message 00..1f
+static void TestSipHash()
+{
+    uint256 hash;
+    for (int i = 0; i < 32; i++)
+        hash.begin()[i] = i;
+    uint64 k0 = 0x0706050403020100ULL;
+    uint64 k1 = 0x0f0e0d0c0b0a0908ULL;
+    CHECK(hash.GetHash(k0, k1) == 0x7127512f72f27cceULL);
+    CHECK(hash.GetHash(k0, k1, 0x23222120) == 0x314dffbe0815a3b4ULL);
+    CHECK(hash.GetHash(k0, k1 ^ 1) != hash.GetHash(k0, k1));
+}
+
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+
+    TestSipHash();
+    TestNoFalseNegatives(1);
+    TestNoFalseNegatives(2);
+    TestNoFalseNegatives(101);
+    TestNoFalseNegatives(1000);
+    TestRollover(1000, 0.001);
+    TestRollover(5000, 0.01);
+    TestFPRate(ADDR_KNOWN_ELEMENTS, ADDR_KNOWN_FP_RATE);
+    TestFPRate(10000, 0.01);
+    TestFPRate(1000, 0.0001);
+    TestClear();
+
+    if (nFailures)
+    {
+        printf("%d checks failed\n", nFailures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -595,7 +595,7 @@ bool CMainFrame::InsertTransaction(const CWalletTx& wtx, bool fNew, int nIndex)
 
     // Find the block the tx is in
     CBlockIndex* pindex = NULL;
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
     if (mi != mapBlockIndex.end())
         pindex = (*mi).second;
 
@@ -825,7 +825,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
 
             // Do the newest transactions first
             vSorted.reserve(mapWallet.size());
-            for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
             {
                 const CWalletTx& wtx = (*it).second;
                 unsigned int nTime = UINT_MAX - wtx.GetTxTime();
@@ -848,7 +848,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
             {
                 fEntered = true;
                 uint256& hash = vSorted[i++].second;
-                map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+                WalletMap::iterator mi = mapWallet.find(hash);
                 if (mi != mapWallet.end())
                     InsertTransaction((*mi).second, true);
             }
@@ -870,7 +870,7 @@ void CMainFrame::OnIdle(wxIdleEvent& event)
             TRY_CRITICAL_BLOCK(cs_mapWallet)
             {
                 nLastTime = GetTime();
-                for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+                for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
                 {
                     CWalletTx& wtx = (*it).second;
                     if (wtx.nTimeDisplayed && wtx.nTimeDisplayed != wtx.GetTxTime())
@@ -911,7 +911,7 @@ void CMainFrame::RefreshStatusColumn()
         for (int nIndex = nStart; nIndex < min(nEnd, m_listCtrl->GetItemCount()); nIndex++)
         {
             uint256 hash((string)GetItemText(m_listCtrl, nIndex, 1));
-            map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+            WalletMap::iterator mi = mapWallet.find(hash);
             if (mi == mapWallet.end())
             {
                 printf("CMainFrame::RefreshStatusColumn() : tx not found in mapWallet\n");
@@ -1018,7 +1018,7 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
                     strTop = (string)m_listCtrl->GetItemText(0);
                 BOOST_FOREACH(uint256 hash, vWalletUpdated)
                 {
-                    map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+                    WalletMap::iterator mi = mapWallet.find(hash);
                     if (mi != mapWallet.end())
                         InsertTransaction((*mi).second, false);
                 }
@@ -1036,7 +1036,7 @@ void CMainFrame::OnPaintListCtrl(wxPaintEvent& event)
 
             // Count hidden and multi-line transactions
             nTransactionCount = 0;
-            for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            for (WalletMap::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
             {
                 CWalletTx& wtx = (*it).second;
                 nTransactionCount += wtx.nLinesDisplayed;
@@ -1201,7 +1201,7 @@ void CMainFrame::OnListItemActivated(wxListEvent& event)
     CWalletTx wtx;
     CRITICAL_BLOCK(cs_mapWallet)
     {
-        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        WalletMap::iterator mi = mapWallet.find(hash);
         if (mi == mapWallet.end())
         {
             printf("CMainFrame::OnListItemActivated() : tx not found in mapWallet\n");
@@ -1447,7 +1447,7 @@ CTxDetailsDialog::CTxDetailsDialog(wxWindow* parent, CWalletTx wtx) : CTxDetails
                 BOOST_FOREACH(const CTxIn& txin, wtx.vin)
                 {
                     COutPoint prevout = txin.prevout;
-                    map<uint256, CWalletTx>::iterator mi = mapWallet.find(prevout.hash);
+                    WalletMap::iterator mi = mapWallet.find(prevout.hash);
                     if (mi != mapWallet.end())
                     {
                         const CWalletTx& prev = (*mi).second;
@@ -26,6 +26,56 @@ inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
 
 
+// SipHash-2-4, a keyed hash short enough for hash tables.  Without the
+// 128-bit key nobody can tell which inputs will collide.
+inline uint64 SipRotl(uint64 x, int b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+inline void SipRound(uint64& v0, uint64& v1, uint64& v2, uint64& v3)
+{
+    v0 += v1; v1 = SipRotl(v1, 13); v1 ^= v0; v0 = SipRotl(v0, 32);
+    v2 += v3; v3 = SipRotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = SipRotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = SipRotl(v1, 17); v1 ^= v2; v2 = SipRotl(v2, 32);
+}
+
+// Hashes nWords little endian 32-bit words
+inline uint64 SipHash(uint64 k0, uint64 k1, const unsigned int* pn, int nWords)
+{
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    int i = 0;
+    for (; i + 2 <= nWords; i += 2)
+    {
+        uint64 m = (uint64)pn[i] | ((uint64)pn[i+1] << 32);
+        v3 ^= m;
+        SipRound(v0, v1, v2, v3);
+        SipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    // The last block has the length in bytes in its top byte
+    uint64 m = (uint64)(nWords * 4) << 56;
+    if (i < nWords)
+        m |= pn[i];
+    v3 ^= m;
+    SipRound(v0, v1, v2, v3);
+    SipRound(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    for (int n = 0; n < 4; n++)
+        SipRound(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+
 // We have to keep a separate base class without constructors
 // so the compiler will let us use it in a union
 template<unsigned int BITS>
@@ -362,6 +412,22 @@ public:
         return sizeof(pn);
     }
 
+    // Keyed hash for hash tables and filters.  nExtra lets the caller fold
+    // in an index or type that goes with the number.
+    uint64 GetHash(uint64 k0, uint64 k1) const
+    {
+        return SipHash(k0, k1, pn, WIDTH);
+    }
+
+    uint64 GetHash(uint64 k0, uint64 k1, unsigned int nExtra) const
+    {
+        unsigned int pnExtra[WIDTH+1];
+        for (int i = 0; i < WIDTH; i++)
+            pnExtra[i] = pn[i];
+        pnExtra[WIDTH] = nExtra;
+        return SipHash(k0, k1, pnExtra, WIDTH+1);
+    }
+
 
     unsigned int GetSerializeSize(int nType=0, int nVersion=VERSION) const
     {
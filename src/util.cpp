@@ -136,6 +136,79 @@ int GetRandInt(int nMax)
     return GetRand(nMax);
 }
 
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double dFPRate)
+{
+    // Each filter holds half the elements, so the two newest always cover
+    // the last nElements keys.  A key is checked against all three, so each
+    // gets a third of the error budget.
+    nGenerationSize = max(1u, (nElements + 1) / 2);
+    double dRate = max(1e-12, min(0.5, dFPRate / 3));
+    double dBits = -(double)nGenerationSize * log(dRate) / (log(2.0) * log(2.0));
+    nBits = max(64u, ((unsigned int)ceil(dBits) + 63) & ~63u);
+    nHashFuncs = max(1, min(50, (int)((double)nBits / nGenerationSize * log(2.0) + 0.5)));
+    nKey0 = GetRand(UINT64_MAX);
+    nKey1 = GetRand(UINT64_MAX);
+    for (int i = 0; i < 3; i++)
+        vData[i].resize(nBits / 64);
+    nCurrent = 0;
+    nInGeneration = 0;
+}
+
+// Bit positions are h1 + i*h2 mod 2^32, from the two halves of a keyed hash
+// of the key.  The wraparound keeps the positions of one key from all
+// landing on alternating even and odd bits.
+bool CRollingBloomFilter::contains(int nFilter, const uint256& hash) const
+{
+    const vector<uint64>& vBits = vData[nFilter];
+    uint64 h = hash.GetHash(nKey0, nKey1);
+    unsigned int h1 = h >> 32;
+    unsigned int h2 = (h & 0xffffffff) | 1;
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nBit = (h1 + i * h2) % nBits;
+        if (!(vBits[nBit >> 6] & ((uint64)1 << (nBit & 63))))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    for (int i = 0; i < 3; i++)
+        if (contains(i, hash))
+            return true;
+    return false;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    if (nInGeneration >= nGenerationSize)
+    {
+        // The oldest filter is forgotten and becomes the current one
+        nCurrent = (nCurrent + 1) % 3;
+        fill(vData[nCurrent].begin(), vData[nCurrent].end(), 0);
+        nInGeneration = 0;
+    }
+
+    vector<uint64>& vBits = vData[nCurrent];
+    uint64 h = hash.GetHash(nKey0, nKey1);
+    unsigned int h1 = h >> 32;
+    unsigned int h2 = (h & 0xffffffff) | 1;
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nBit = (h1 + i * h2) % nBits;
+        vBits[nBit >> 6] |= ((uint64)1 << (nBit & 63));
+    }
+    nInGeneration++;
+}
+
+void CRollingBloomFilter::clear()
+{
+    for (int i = 0; i < 3; i++)
+        fill(vData[i].begin(), vData[i].end(), 0);
+    nInGeneration = 0;
+}
+
 
 
 
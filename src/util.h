@@ -111,6 +111,7 @@ typedef int socklen_t;
 #define WSAEINPROGRESS      EINPROGRESS
 #define WSAEADDRINUSE       EADDRINUSE
 #define WSAENOTSOCK         EBADF
+#define WSAEMFILE           EMFILE
 #define INVALID_SOCKET      (SOCKET)(~0)
 #define SOCKET_ERROR        -1
 typedef u_int SOCKET;
@@ -221,6 +222,67 @@ std::string FormatFullVersion();
 
 
 
+class COutPoint;
+class CInv;
+
+// Hasher for unordered containers keyed by uint256, COutPoint or CInv.
+// Each container gets its own random SipHash key, so peers can't choose
+// keys that all share a bucket.  The COutPoint and CInv versions are
+// defined next to those classes.
+class CSaltedHasher
+{
+public:
+    CSaltedHasher()
+    {
+        nKey0 = GetRand(UINT64_MAX);
+        nKey1 = GetRand(UINT64_MAX);
+    }
+
+    size_t operator()(const uint256& hash) const
+    {
+        return (size_t)hash.GetHash(nKey0, nKey1);
+    }
+
+    size_t operator()(const COutPoint& outpoint) const;
+    size_t operator()(const CInv& inv) const;
+
+private:
+    uint64 nKey0;
+    uint64 nKey1;
+};
+
+
+
+// Remembers at least the last nElements keys inserted in fixed memory.
+// Keys go into three bloom filters that each take half of them; once the
+// newest is full the oldest is dropped and reused.  contains() is never
+// wrong about the last nElements keys, and wrongly says yes to others with
+// a probability of at most dFPRate.
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double dFPRate);
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+    void clear();
+    size_t GetMemoryUsage() const { return 3 * vData[0].size() * sizeof(uint64); }
+
+private:
+    std::vector<uint64> vData[3];
+    unsigned int nBits;
+    unsigned int nHashFuncs;
+    unsigned int nGenerationSize;
+    unsigned int nInGeneration;
+    int nCurrent;
+    uint64 nKey0;
+    uint64 nKey1;
+
+    bool contains(int nFilter, const uint256& hash) const;
+};
+
+
+
+
 // Wrapper to automatically initialize critical sections
 class CCriticalSection
 {